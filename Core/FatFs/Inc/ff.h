@@ -145,6 +145,29 @@ typedef struct {
 #endif
 
 
+/* Size of the scratch buffer in the filesystem object [sectors]. It is shared by the
+   2nd FAT copy (FF_FS_LAZYFAT), the exFAT allocation bitmap cache (FF_FS_BMCACHE) and
+   the directory read-ahead (FF_FS_DIRBURST), and is as large as the largest of them. */
+
+#if !FF_FS_READONLY && FF_FS_LAZYFAT
+#define FF_SBUF_FAT2	4
+#else
+#define FF_SBUF_FAT2	0
+#endif
+#if FF_FS_EXFAT && !FF_FS_READONLY && FF_FS_BMCACHE
+#define FF_SBUF_BM		FF_FS_BMCACHE
+#else
+#define FF_SBUF_BM		0
+#endif
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+#define FF_SBUF_DIR		FF_FS_DIRBURST
+#else
+#define FF_SBUF_DIR		0
+#endif
+#define FF_SBUF_SECT	(FF_SBUF_FAT2 > FF_SBUF_BM ? (FF_SBUF_FAT2 > FF_SBUF_DIR ? FF_SBUF_FAT2 : FF_SBUF_DIR) : (FF_SBUF_BM > FF_SBUF_DIR ? FF_SBUF_BM : FF_SBUF_DIR))
+
+
+
 /* Filesystem object structure (FATFS) */
 
 typedef struct {
@@ -167,6 +190,10 @@ typedef struct {
 	DWORD	last_clst;	/* Last allocated cluster (invalid if >=n_fatent) */
 	DWORD	free_clst;	/* Number of free clusters (invalid if >=fs->n_fatent-2) */
 #endif
+#if !FF_FS_READONLY && FF_FS_AUALIGN
+	DWORD	au_clst;	/* Size of the device allocation unit in cluster (0:do not align) */
+	DWORD	au_top;		/* First cluster on an allocation unit boundary */
+#endif
 #if FF_FS_RPATH
 	DWORD	cdir;		/* Current directory start cluster (0:root) */
 #endif
@@ -184,6 +211,28 @@ typedef struct {
 	FFXCWDS	xcwds;		/* Crrent working directory structure */
 	FFXCWDS	xcwds2;		/* Working buffer to follow the path */
 #endif
+#endif
+#if !FF_FS_READONLY && FF_FS_LAZYFAT
+	UINT	n_fat2run;	/* Number of items in fat2run[] */
+	DWORD	fat2run[FF_FS_LAZYFAT][2];	/* Sorted runs of the 1st FAT not reflected to the 2nd FAT {sector offset, count} */
+#endif
+#if FF_FS_EXFAT && !FF_FS_READONLY && FF_FS_BMCACHE
+	UINT	n_bmsect;	/* Number of sectors of the bitmap cache in sbuf[] (0:empty) */
+	UINT	bmdlo;		/* Dirty sector range in the bitmap cache {bmdlo, bmdhi} (bmdhi == 0:clean) */
+	UINT	bmdhi;
+	LBA_t	bmsect;		/* Sector LBA of the top of the bitmap cache in sbuf[] */
+#endif
+#if FF_FS_DIRCACHE
+	DWORD	dcache[FF_FS_DIRCACHE][4];	/* Directory lookup cache {directory cluster, name hash, entry block offset, last entry offset} */
+#endif
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+	UINT	n_rasect;	/* Number of sectors of the directory read-ahead in sbuf[] (0:empty) */
+	BYTE	raflag;		/* Directory read-ahead status (1:enabled) */
+	LBA_t	rasect;		/* Sector LBA of the top of the directory read-ahead in sbuf[] */
+#endif
+#if FF_SBUF_SECT
+	BYTE	sbuf_use;	/* Current user of sbuf[] (0:none, 1:2nd FAT copy, 2:bitmap cache, 3:directory read-ahead) */
+	BYTE	sbuf[FF_MAX_SS * FF_SBUF_SECT];	/* Scratch buffer shared by the users above */
 #endif
 	BYTE	win[FF_MAX_SS];	/* Disk access window for directory, FAT (and file data in tiny cfg) */
 } FATFS;
@@ -226,9 +275,34 @@ typedef struct {
 	LBA_t	dir_sect;	/* Sector number containing the directory entry (not used in exFAT) */
 	BYTE*	dir_ptr;	/* Pointer to the directory entry in the win[] (not used in exFAT) */
 #endif
+#if !FF_FS_READONLY && FF_FS_LAZYSYNC
+	FSIZE_t	dir_size;	/* File size recorded in the directory entry */
+	DWORD	dir_sclust;	/* Start cluster recorded in the directory entry */
+#if FF_FS_LAZYSYNC_SEC
+	DWORD	dir_tick;	/* Tick of the last directory entry update [ms] */
+#endif
+	UINT	n_sync;		/* Number of f_sync calls since the last directory entry update */
+#endif
 #if FF_USE_FASTSEEK
 	DWORD*	cltbl;		/* Pointer to the cluster link map table (nulled on open; set by application) */
 #endif
+#if FF_USE_EXPAND
+	DWORD	n_ctg;		/* Number of contiguous clusters from the top of the file (0:not known) */
+#endif
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+	BYTE*	wbuf;		/* Pointer to the write-behind buffer (nulled on open; set by f_setwbuf) */
+	UINT	sz_wbuf;	/* Size of wbuf[] [sectors] */
+	UINT	n_wbsect;	/* Number of sectors held in wbuf[] */
+	LBA_t	wbsect;		/* Sector number of the top of wbuf[] */
+#endif
+#if !FF_FS_TINY && FF_USE_RBUF
+	BYTE*	rbuf;		/* Pointer to the read-ahead buffer (nulled on open; set by f_setrbuf) */
+	UINT	sz_rbuf;	/* Size of rbuf[] [sectors] */
+	UINT	n_rbsect;	/* Number of sectors held in rbuf[] */
+	UINT	rbwin;		/* Number of sectors to be read ahead at next refill (0:not sequential) */
+	UINT	rbofs;		/* Offset of the held sectors in rbuf[] [sectors] (f_forward alternates the halves) */
+	LBA_t	rbsect;		/* Sector number of the first held sector */
+#endif
 #if !FF_FS_TINY
 	BYTE	buf[FF_MAX_SS];	/* File private data read/write window */
 #endif
@@ -276,6 +350,21 @@ typedef struct {
 
 
 
+/* Compact directory entry structure (FFDIRENT) used for f_readdirs() */
+
+typedef struct {
+	FSIZE_t	fsize;			/* File size (invalid for directory) */
+	DWORD	sclust;			/* Start cluster (0:no data) */
+	BYTE	fattrib;		/* Object attribute */
+#if FF_USE_LFN
+	TCHAR	fname[FF_LFN_BUF + 1];	/* Object name */
+#else
+	TCHAR	fname[12 + 1];	/* Object name */
+#endif
+} FFDIRENT;
+
+
+
 /* Format parameter structure (MKFS_PARM) used for f_mkfs() */
 
 typedef struct {
@@ -323,13 +412,17 @@ typedef enum {
 FRESULT f_open (FIL* fp, const TCHAR* path, BYTE mode);				/* Open or create a file */
 FRESULT f_close (FIL* fp);											/* Close an open file object */
 FRESULT f_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from the file */
+FRESULT f_setrbuf (FIL* fp, void* buf, UINT sz);					/* Attach a read-ahead buffer to the file */
+FRESULT f_getview (FIL* fp, const void** view, UINT btr, UINT* br);	/* Get a pointer to the file data instead of reading it */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to the file */
 FRESULT f_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate the file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of the writing file */
+FRESULT f_setwbuf (FIL* fp, void* buf, UINT sz);					/* Attach a write-behind buffer to the file */
 FRESULT f_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
 FRESULT f_closedir (DIR* dp);										/* Close an open directory */
 FRESULT f_readdir (DIR* dp, FILINFO* fno);							/* Read a directory item */
+FRESULT f_readdirs (DIR* dp, FFDIRENT* ents, UINT n, UINT* nr);	/* Read directory items into an array */
 FRESULT f_findfirst (DIR* dp, FILINFO* fno, const TCHAR* path, const TCHAR* pattern);	/* Find first file */
 FRESULT f_findnext (DIR* dp, FILINFO* fno);							/* Find next file */
 FRESULT f_mkdir (const TCHAR* path);								/* Create a sub directory */
@@ -338,6 +431,7 @@ FRESULT f_rename (const TCHAR* path_old, const TCHAR* path_new);	/* Rename/Move
 FRESULT f_stat (const TCHAR* path, FILINFO* fno);					/* Get file status */
 FRESULT f_chmod (const TCHAR* path, BYTE attr, BYTE mask);			/* Change attribute of a file/dir */
 FRESULT f_utime (const TCHAR* path, const FILINFO* fno);			/* Change timestamp of a file/dir */
+FRESULT f_recover (const TCHAR* path);								/* Reconcile the file size with the cluster chain */
 FRESULT f_chdir (const TCHAR* path);								/* Change current directory */
 FRESULT f_chdrive (const TCHAR* path);								/* Change current drive */
 FRESULT f_getcwd (TCHAR* buff, UINT len);							/* Get current directory */
@@ -378,6 +472,11 @@ TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the fil
 DWORD get_fattime (void);	/* Get current time */
 #endif
 
+/* Tick function (provided by user) */
+#if !FF_FS_READONLY && FF_FS_LAZYSYNC && FF_FS_LAZYSYNC_SEC
+DWORD FF_FS_LAZYSYNC_TICK (void);	/* Get a free-running millisecond counter */
+#endif
+
 
 /* LFN support functions (defined in ffunicode.c) */
 
@@ -416,6 +515,7 @@ void ff_mutex_give (int vol);		/* Unlock sync object */
 #define	FA_CREATE_ALWAYS	0x08
 #define	FA_OPEN_ALWAYS		0x10
 #define	FA_OPEN_APPEND		0x30
+#define	FA_CONTIGUOUS		0x40
 
 /* Fast seek controls (2nd argument of f_lseek function) */
 #define CREATE_LINKMAP	((FSIZE_t)0 - 1)
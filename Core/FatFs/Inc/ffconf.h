@@ -38,8 +38,12 @@
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_EXPAND	0
-/* This option switches f_expand(). (0:Disable or 1:Enable) */
+#define FF_USE_EXPAND	1
+/* This option switches f_expand() and FA_CONTIGUOUS open mode. (0:Disable or 1:Enable)
+/  A file allocated by f_expand(), or opened with FA_CONTIGUOUS, is known to be
+/  contiguous and f_read(), f_write() and f_lseek() compute the clusters in it from
+/  the start cluster without looking up the FAT. With FF_USE_ZERO = 1, f_expand()
+/  with opt = 3 also fills the allocated block with zeros. */
 
 
 #define FF_USE_CHMOD	0
@@ -52,8 +56,46 @@
 /  (0:Disable or 1:Enable) */
 
 
-#define FF_USE_FORWARD	0
-/* This option switches f_forward(). (0:Disable or 1:Enable) */
+#define FF_USE_FORWARD	1
+/* This option switches f_forward(). (0:Disable or 1:Enable)
+/  When the file has a read-ahead buffer (FF_USE_RBUF), f_forward() works in streaming
+/  mode. The buffer is split into two banks and the file data is handed over to the
+/  streaming function a bank at a time in the buffer it was read into. When a bank is
+/  consumed, the next bank is read while the streaming function transfers the data, so
+/  that the function can start a DMA transfer and return. The function must report
+/  busy on the sense call until the transfer is done, and the transfer must be done
+/  before the file is accessed by other functions. */
+
+
+#define FF_USE_WBUF		1
+/* This option switches f_setwbuf(), which attaches a write-behind buffer to a file
+/  object. The sectors filled by f_write() are collected in the buffer and written in
+/  a multi-sector write when it is full, when the written sectors are no longer
+/  contiguous, at f_sync(), f_close(), f_read(), f_truncate() or f_lseek() away from
+/  the file pointer. A buffer of multiple of the cluster size is recommended. The
+/  string functions, f_putc(), f_puts() and f_printf(), write through f_write() and
+/  the text output is collected in the buffer as well. This option has no effect
+/  when FF_FS_READONLY == 1 or FF_FS_TINY == 1.
+/  (0:Disable or 1:Enable) */
+
+
+#define FF_USE_RBUF		1
+/* This option switches f_setrbuf(), which attaches a read-ahead buffer to a file
+/  object. When f_read() goes on reading the file sequentially through the sector
+/  cache, the following sectors up to the end of the contiguous cluster run are read
+/  into the buffer in a multi-sector read and the sector cache is filled from it. The
+/  read-ahead size starts at two sectors, doubles at each refill up to the buffer
+/  size and it is reset by f_lseek(). This option has no effect when FF_FS_TINY == 1.
+/  (0:Disable or 1:Enable) */
+
+
+#define FF_USE_VIEW		1
+/* This option switches f_getview(), a zero-copy alternative to f_read(). It returns
+/  a read-only pointer to the file data in the sector cache, or in the read-ahead
+/  buffer when the file has one, and moves the file pointer past the data. The data
+/  can span all the sectors held in the read-ahead buffer. The pointer is valid until
+/  the next function call with the file object. This option has no effect when
+/  FF_FS_TINY == 1. (0:Disable or 1:Enable) */
 
 
 #define FF_USE_STRFUNC	1
@@ -178,7 +220,7 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
-#define FF_VOLUMES		1
+#define FF_VOLUMES		2
 /* Number of volumes (logical drives) to be used. (1-10) */
 
 
@@ -225,12 +267,20 @@
 /  f_fdisk(). 2^32 sectors maximum. This option has no effect when FF_LBA64 == 0. */
 
 
-#define FF_USE_TRIM		0
+#define FF_USE_TRIM		1
 /* This option switches support for ATA-TRIM. (0:Disable or 1:Enable)
 /  To enable this feature, also CTRL_TRIM command should be implemented to
 /  the disk_ioctl(). */
 
 
+#define FF_USE_ZERO		1
+/* This option switches support for zero-fill command. (0:Disable or 1:Enable)
+/  When enabled, a directory cluster to be cleared (f_mkdir() and growing a
+/  directory) and the block allocated by f_expand() with opt = 3 are filled with
+/  zeros by CTRL_ZERO command of disk_ioctl() in a request. When the command fails,
+/  the sectors are written from the zero-filled window as before. */
+
+
 
 /*---------------------------------------------------------------------------/
 / System Configurations
@@ -280,6 +330,111 @@
 */
 
 
+#define FF_FS_LAZYFAT	8
+/* This option defers mirroring of the 1st FAT into the 2nd FAT on the volumes with
+/  two FATs. The 1st FAT is always written first, when the sector leaves the window,
+/  and it is the only FAT FatFs reads. The sectors written to it are tracked as runs
+/  and copied into the 2nd FAT in multi-sector writes when the volume is synchronized
+/  (f_sync(), f_close(), the other modifying functions and f_unmount()). Until then
+/  the 2nd FAT holds the allocation state at the last sync. The runs are copied
+/  through the scratch buffer of the filesystem object (FATFS), see FF_FS_BMCACHE.
+/  This option has no effect at read-only configuration.
+/
+/   0: Disable. Each FAT sector is reflected to the 2nd FAT when it is written.
+/  >1: Number of sector runs to be tracked. When the table is full, the closest runs
+/      are merged, so that the clean sectors between them are copied too.
+*/
+
+
+#define FF_FS_LAZYSYNC	8
+#define FF_FS_LAZYSYNC_SEC	10
+#define FF_FS_LAZYSYNC_TICK	HAL_GetTick
+/* This option defers the directory entry update of f_sync() for the files being
+/  appended, such as logs synced periodically. The file data, the FAT and the
+/  allocation bitmap are always flushed by f_sync(), but the file size and the
+/  modified time in the directory entry are updated only on every FF_FS_LAZYSYNC
+/  th f_sync() call, when FF_FS_LAZYSYNC_SEC seconds have elapsed since the last
+/  update, when the file size crosses a cluster boundary or shrinks, or on
+/  f_close(). A sync is deferred only when the end of the file is in the sector
+/  it writes with room for a 20-byte size checkpoint after it, which goes into
+/  the end of that sector. After an unclean shutdown, the size in the directory
+/  entry can fall behind the synced data in its last cluster, and f_recover() can
+/  be used to restore it from the checkpoint after mount. This option has no effect
+/  at read-only configuration.
+/
+/   0: Disable. Every f_sync() call updates the directory entry.
+/  >0: Maximum number of f_sync() calls per directory entry update.
+/
+/  FF_FS_LAZYSYNC_SEC is the maximum interval of the directory entry updates in
+/  unit of second (0:no limit). The time is measured with the function named by
+/  FF_FS_LAZYSYNC_TICK, which returns a free-running millisecond counter as
+/  DWORD. It is declared in ff.h and needs to be provided by the user when it is
+/  not a HAL function.
+*/
+
+
+#define FF_FS_BMCACHE	8
+/* This option specifies the size of the allocation bitmap cache on the exFAT volume
+/  in unit of sector. The bitmap is read into the cache a window of FF_FS_BMCACHE
+/  sectors at a time, scanned for free clusters a word at a time and changed in the
+/  cache. The changed sectors are written back in a multi-sector write when the
+/  window moves or the volume is synchronized. This option has no effect when
+/  FF_FS_EXFAT = 0 or at read-only configuration.
+/
+/  The cache lives in a scratch buffer of the filesystem object (FATFS), which is
+/  shared with the copy to the 2nd FAT (4 sectors when FF_FS_LAZYFAT > 0) and the
+/  directory read-ahead (FF_FS_DIRBURST). The buffer is as large as the largest of
+/  them and it is handed over on demand, the cache is written back when it loses
+/  the buffer.
+/
+/   0: Disable. The bitmap is accessed through the sector window.
+/  >0: Number of sectors of the cache.
+*/
+
+
+#define FF_FS_AUALIGN	16
+/* This option places large allocations on the allocation unit (AU) boundaries of
+/  the device, which is got with GET_BLOCK_SIZE command of disk_ioctl() at mount.
+/  When a new cluster chain of at least an AU is created by f_write() or f_lseek(),
+/  or a block of at least an AU is allocated by f_expand(), it is placed on an AU
+/  boundary in whole free AUs if they are found within FF_FS_AUALIGN AU boundaries
+/  from the last allocated cluster. Otherwise it is allocated in the regular way.
+/  The write performance of SD memory cards, such as the speed class, is specified
+/  for writes filling whole AUs. This option has no effect at read-only
+/  configuration.
+/
+/   0: Disable.
+/  >0: Number of AU boundaries to be tried at most per allocation.
+*/
+
+
+#define FF_FS_DIRCACHE	32
+/* This option specifies the number of slots of the directory lookup cache. Each
+/  slot remembers where an object name was found or created in a directory, so
+/  that following look-ups of the name, such as f_open() and f_stat(), load the
+/  entry directly instead of scanning the directory from the top. The location
+/  is verified on each hit, and a stale slot falls back to the directory scan.
+/  The filesystem object (FATFS) increases FF_FS_DIRCACHE * 16 bytes.
+/
+/   0: Disable the directory lookup cache.
+/  >0: Number of the cache slots.
+*/
+
+
+#define FF_FS_DIRBURST	4
+/* This option enables f_readdirs() function, which reads the directory items into
+/  an array of compact entries (FFDIRENT) in a call. It reads the directory sectors
+/  in bursts of up to FF_FS_DIRBURST sectors within a cluster into a read-ahead
+/  buffer, and the sector window is filled from it. The buffer is kept across the
+/  calls and discarded on any write to the volume or when the scratch buffer it
+/  lives in is taken over (see FF_FS_BMCACHE). This option has no effect when
+/  FF_FS_MINIMIZE >= 2.
+/
+/   0: Disable f_readdirs() function.
+/  >1: Number of sectors to be read in a burst.
+*/
+
+
 #define FF_FS_LOCK		0
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects. This option must be 0 when FF_FS_READONLY
@@ -0,0 +1,157 @@
+/******************************************************************************
+ *  File        : sd_block.h
+ *  Author      : ControllersTech
+ *  Website     : https://controllerstech.com
+ *  Date        : June 26, 2025
+ *
+ *  Description :
+ *    This file is part of a custom STM32/Embedded tutorial series.
+ *    For documentation, updates, and more examples, visit the website above.
+ *
+ *  Note :
+ *    This code is written and maintained by ControllersTech.
+ *    You are free to use and modify it for learning and development.
+ ******************************************************************************/
+
+#ifndef __SD_BLOCK_H__
+#define __SD_BLOCK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "diskio.h"
+
+/* Block devices are stacked per drive in diskio.c: a bottom device (SD card,
+ * stripe, RAM disk) with any number of layers on top (cache, stats, fault
+ * injection). A layer leaves the ops it does not change NULL, the call then
+ * goes to the device below it. */
+
+typedef struct BlockDev BlockDev;
+
+/* What a device handles best, for the layers above it */
+typedef struct {
+	UINT max_burst;		/* Most sectors per request, 0: no limit */
+	UINT align;			/* Requests aligned to this many sectors use the device best */
+	DWORD erase_unit;	/* Erase block in sectors, 0: unknown */
+} BlockCaps;
+
+typedef struct {
+	DSTATUS (*init)(BlockDev *dev);
+	DSTATUS (*status)(BlockDev *dev);
+	DRESULT (*read)(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count);
+	DRESULT (*write)(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count);
+	DRESULT (*ioctl)(BlockDev *dev, BYTE cmd, void *buff);
+	DRESULT (*flush)(BlockDev *dev);	/* Write back and finish pending writes (CTRL_SYNC) */
+	DRESULT (*caps)(BlockDev *dev, BlockCaps *caps);
+} BlockOps;
+
+struct BlockDev {
+	const BlockOps *ops;
+	BlockDev *lower;	/* Device under this layer, NULL for a bottom device */
+	void *ctx;			/* State of the layer or device */
+	BYTE unit;			/* Card number of the SD device */
+};
+
+/* Calls into a stack, from its top or from a layer to its lower device */
+DSTATUS Block_Init(BlockDev *dev);
+DSTATUS Block_Status(BlockDev *dev);
+DRESULT Block_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count);
+DRESULT Block_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count);
+DRESULT Block_Ioctl(BlockDev *dev, BYTE cmd, void *buff);
+DRESULT Block_Flush(BlockDev *dev);
+DRESULT Block_GetCaps(BlockDev *dev, BlockCaps *caps);
+
+/* Bottom devices */
+extern const BlockOps block_sd_ops;			/* One SD card, unit is its sd_spi.c drive */
+extern const BlockOps block_stripe_ops;		/* The sd_stripe.c volume */
+extern const BlockOps block_ram_ops;		/* RAM disk (BlockRam) */
+
+typedef struct {
+	BYTE *mem;			/* sectors * 512 bytes */
+	LBA_t sectors;
+} BlockRam;
+
+#define BLOCK_SD(unit)			{ &block_sd_ops, NULL, NULL, (unit) }
+#define BLOCK_STRIPE()			{ &block_stripe_ops, NULL, NULL, 0 }
+#define BLOCK_RAM(ram)			{ &block_ram_ops, NULL, (ram), 0 }
+
+/* Layers */
+extern const BlockOps block_stats_ops;		/* Request counters and trace */
+extern const BlockOps block_cache_ops;		/* Sector cache, write-back */
+extern const BlockOps block_fault_ops;		/* Fails chosen requests */
+
+#define BLOCK_TRACE 16	/* Requests kept in the stats trace */
+
+typedef struct {
+	uint32_t tick;		/* HAL_GetTick() at the start */
+	BYTE op;			/* 'R', 'W' or 'S' (flush) */
+	BYTE res;			/* DRESULT */
+	UINT count;
+	LBA_t sector;
+	uint32_t ms;		/* Time taken */
+} BlockTraceEntry;
+
+typedef struct {
+	uint32_t reads, writes, flushes, ioctls, errors;
+	uint32_t read_sectors, write_sectors;
+	uint32_t read_ms, write_ms, flush_ms;
+	BlockTraceEntry trace[BLOCK_TRACE];	/* Last requests, trace_n % BLOCK_TRACE is the next one */
+	uint32_t trace_n;
+} BlockStats;
+
+#define BLOCK_GET_STATS	18	/* Get the counters of the top stats layer (BlockStats) */
+
+/* Cache geometry: a sector goes to set (sector % BLOCK_CACHE_SETS), in any of its
+ * BLOCK_CACHE_WAYS slots. Sectors in consecutive sets of one way are next to each
+ * other in memory, so a run of them is written back with one multi-block write. */
+#define BLOCK_CACHE_SETS	16
+#define BLOCK_CACHE_WAYS	2
+#define BLOCK_CACHE_SLOTS	(BLOCK_CACHE_SETS * BLOCK_CACHE_WAYS)
+
+/* Slots of a cache layer, in the DMA buffer section, e.g.
+ * static BLOCK_CACHE_DATA(sd0_slots); */
+#define BLOCK_CACHE_DATA(name) \
+	BYTE name[BLOCK_CACHE_SLOTS][512] __attribute__((section(".dma_buffer"), aligned(32)))
+
+typedef struct {
+	uint32_t hits, misses;	/* Single-sector reads and writes */
+	uint32_t evictions;		/* Cached sectors replaced by others */
+	uint32_t absorbed;		/* Writes to a sector that was still dirty */
+	uint32_t writebacks;	/* Multi-block writes of dirty runs */
+	uint32_t written;		/* Sectors in them */
+	uint32_t dirty;			/* Sectors waiting to be written now */
+	uint32_t lost;			/* Dirty sectors dropped with a card that went down */
+} BlockCacheStats;
+
+#define BLOCK_GET_CACHE	19	/* Get the counters of the top cache layer (BlockCacheStats) */
+#define BLOCK_CLEAR_LOST	20	/* Clear the lost count of the top cache layer, its drive can be initialized again */
+
+typedef struct {
+	LBA_t sector;
+	uint32_t used;		/* Cache clock at the last access */
+	BYTE valid, dirty;
+} BlockCacheLine;
+
+/* Single-sector writes are held until CTRL_SYNC or until hi_mark sectors are
+ * dirty, then the least recently used are written back down to lo_mark. Longer
+ * writes go straight through. */
+typedef struct {
+	BYTE (*data)[512];	/* BLOCK_CACHE_SLOTS sectors, BLOCK_CACHE_DATA() */
+	UINT hi_mark, lo_mark;
+	UINT max_burst;		/* Longest write-back, max_burst of the device below (0: no limit) */
+	BlockCacheLine line[BLOCK_CACHE_SLOTS];	/* Slot of way w, set s: w * BLOCK_CACHE_SETS + s */
+	uint32_t clock;
+	BlockCacheStats st;
+} BlockCache;
+
+typedef struct {
+	uint32_t every;		/* Fail every Nth request, 0: none */
+	LBA_t bad_st, bad_ed;	/* Requests touching these sectors fail, bad_ed < bad_st: none */
+	BYTE writes_only;	/* Leave reads alone */
+	uint32_t requests, injected;
+} BlockFault;
+
+#define BLOCK_STATS(lower, st)	{ &block_stats_ops, (lower), (st), 0 }
+#define BLOCK_CACHE(lower, c)	{ &block_cache_ops, (lower), (c), 0 }
+#define BLOCK_FAULT(lower, f)	{ &block_fault_ops, (lower), (f), 0 }
+
+#endif // __SD_BLOCK_H__
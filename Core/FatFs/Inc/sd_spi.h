@@ -23,6 +23,7 @@
 #define CMD0  	(0)
 #define CMD8  	(8)
 #define CMD9	(9)			/* SEND_CSD */
+#define CMD10	(10)		/* SEND_CID */
 #define CMD12	(12)		/* STOP_TRANSMISSION */
 #define CMD13	(13)		/* STSTUS */
 #define CMD17 	(17)
@@ -32,14 +33,12 @@
 #define CMD32	(32)		/* ERASE_ER_BLK_START */
 #define CMD33	(33)		/* ERASE_ER_BLK_END */
 #define CMD38	(38)		/* ERASE */
+#define CMD51	(51)		/* SEND_SCR (after CMD55) */
 #define CMD55 	(55)
 #define CMD58 	(58)
 #define ACMD41 	(41)
 #define ACMD13	(0x80+13)	/* SD_STATUS (SDC) */
 
-#define FCLK_SLOW() { MODIFY_REG(SD_SPI_HANDLE.Instance->CR1, SPI_BAUDRATEPRESCALER_256, SPI_BAUDRATEPRESCALER_256); }	/* Set SCLK = slow, approx 280 KBits/s*/
-#define FCLK_FAST() { MODIFY_REG(SD_SPI_HANDLE.Instance->CR1, SPI_BAUDRATEPRESCALER_256, SPI_BAUDRATEPRESCALER_8); }	/* Set SCLK = fast, approx 4.5 MBits/s */
-
 /* MMC card type flags (MMC_GET_TYPE) */
 #define CT_MMC		0x01		/* MMC ver 3 */
 #define CT_SD1		0x02		/* SD ver 1 */
@@ -47,10 +46,71 @@
 #define CT_SDC		(CT_SD1|CT_SD2)	/* SD */
 #define CT_BLOCK	0x08		/* Block addressing */
 
+/* SD status fields (SD_GET_STATUS) */
+typedef struct {
+	uint8_t speed_class;	/* Speed class (0, 2, 4, 6 or 10) */
+	uint8_t uhs_grade;		/* UHS speed grade (0, 1 or 3) */
+	uint8_t video_class;	/* Video speed class (0, 6, 10, 30, 60 or 90) */
+	uint32_t au_sectors;	/* Allocation unit size in sectors (0: not defined) */
+	uint16_t erase_size;	/* Number of AUs erased in erase_timeout (0: not supported) */
+	uint8_t erase_timeout;	/* Time to erase erase_size AUs in seconds */
+	uint8_t erase_offset;	/* Time added to every erase in seconds */
+} SD_Status;
+
+#define SD_GET_STATUS	16	/* Get the parsed SD status (SD_Status) */
+
+/* Error recovery counters (SD_GET_STATS) */
+typedef struct {
+	uint32_t errors;	/* Failed transfers and status checks */
+	uint32_t resync;	/* Recovered by resynchronizing with the card */
+	uint32_t restart;	/* Recovered by restarting SPI and DMA */
+	uint32_t reinit;	/* Recovered by initializing the card again */
+	uint32_t failed;	/* Not recovered, card left uninitialized */
+} SD_Stats;
+
+#define SD_GET_STATS	17	/* Get the error recovery counters (SD_Stats) */
+
+/* Card socket wiring (sd_socket[] in sd_spi.c), one per drive */
+typedef struct {
+	SPI_HandleTypeDef *spi;	/* SPI bus, may be shared with other sockets */
+	GPIO_TypeDef *cs_port;	/* Chip select */
+	uint16_t cs_pin;
+	GPIO_TypeDef *cd_port;	/* Card-detect switch, NULL if none */
+	uint16_t cd_pin;
+	uint32_t clk_fast;		/* SPI_BAUDRATEPRESCALER_x once the card is initialized */
+} SD_Socket;
+
+/* One card's share of a transfer over several cards (SD_ReadParallel and
+ * SD_WriteParallel). Its sectors are consecutive on the card, in buff they come
+ * in runs of run sectors with gap sectors of the other cards in between. */
+typedef struct {
+	BYTE pdrv;
+	BYTE *buff;		/* First sector of the chunk */
+	LBA_t sector;	/* Start sector on the card */
+	UINT count;		/* Number of sectors, 0 for none */
+	UINT first;		/* Sectors in the first run (the transfer may start mid-run) */
+	UINT run;		/* Sectors per run after the first */
+	UINT gap;		/* Sectors skipped in buff after each run */
+} SD_Chunk;
+
+/* Asynchronous card initialization (SD_InitStart/SD_InitPoll) */
+typedef enum {
+	SD_INIT_IDLE = 0,	/* Not started or card needs a new init */
+	SD_INIT_BUSY,		/* In progress, keep polling */
+	SD_INIT_READY,		/* Card ready for disk I/O */
+	SD_INIT_FAILED		/* No card or card did not respond */
+} SD_InitState;
+
+typedef void (*SD_InitCallback)(DRESULT res);	/* Called once when the init ends */
+
+void SD_InitStart(BYTE pdrv, SD_InitCallback done);
+SD_InitState SD_InitPoll(BYTE pdrv);
 DRESULT SD_SPI_Init(BYTE pdrv);
 DRESULT SD_ReadBlocks(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
 DRESULT SD_WriteBlocks(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count);
 DRESULT SD_ioctl(BYTE drv, BYTE cmd, void *buff);
+DRESULT SD_ReadParallel(const SD_Chunk *chunk, UINT n);
+DRESULT SD_WriteParallel(const SD_Chunk *chunk, UINT n);
 DSTATUS SD_status (BYTE drv);
 
 #endif // __SD_SPI_H__
@@ -0,0 +1,33 @@
+/******************************************************************************
+ *  File        : sd_stripe.h
+ *  Author      : ControllersTech
+ *  Website     : https://controllerstech.com
+ *  Date        : June 26, 2025
+ *
+ *  Description :
+ *    This file is part of a custom STM32/Embedded tutorial series.
+ *    For documentation, updates, and more examples, visit the website above.
+ *
+ *  Note :
+ *    This code is written and maintained by ControllersTech.
+ *    You are free to use and modify it for learning and development.
+ ******************************************************************************/
+
+#ifndef __SD_STRIPE_H__
+#define __SD_STRIPE_H__
+
+#include "diskio.h"
+#include "sd_block.h"
+
+/* 1: cards 0 and 1 are striped into one volume, drive 0, and drive 1 is not
+ * used. 0: each card is a drive of its own (diskio.c). */
+#define SD_USE_STRIPE	0
+
+DSTATUS SD_StripeInit(void);
+DSTATUS SD_StripeStatus(void);
+DRESULT SD_StripeRead(BYTE *buff, LBA_t sector, UINT count);
+DRESULT SD_StripeWrite(const BYTE *buff, LBA_t sector, UINT count);
+DRESULT SD_StripeIoctl(BYTE cmd, void *buff);
+DRESULT SD_StripeCaps(BlockCaps *caps);
+
+#endif // __SD_STRIPE_H__
@@ -3,19 +3,55 @@
 /*                                                                       */
 /*   Portions COPYRIGHT 2017 STMicroelectronics                          */
 /*   Portions Copyright (C) 2017, ChaN, all right reserved               */
-/*   Modified to directly call SD card functions - proxy layer removed   */
+/*   Modified to call a stack of block devices per drive (sd_block.h)   */
 /*-----------------------------------------------------------------------*/
 
 /* Includes ------------------------------------------------------------------*/
 #include "diskio.h"
-#include "sd_spi.h"
+#include "sd_block.h"
+#include "sd_stripe.h"
+
+/* Each card is a drive of its own, or with SD_USE_STRIPE the two of them are
+ * striped into drive 0 and drive 1 is not used, so no card is ever under two
+ * drives. Each drive is the top of a stack of block devices, layers can be
+ * added or taken out here without touching the SD driver. Drive 0 has a
+ * write-back cache that keeps the FAT, directory and FSINFO sectors FatFs
+ * rewrites over and over until CTRL_SYNC. A RAM disk as a drive of its own
+ * would be:
+ *
+ *   static BYTE ram_mem[64 * 512];
+ *   static BlockRam ram = { ram_mem, 64 };
+ *   static BlockDev ramdisk = BLOCK_RAM(&ram);
+ */
+static BlockStats drv0_stats, drv1_stats;
+static BLOCK_CACHE_DATA(drv0_slots);
+static BlockCache drv0_cache = {
+	.data = drv0_slots,
+	.hi_mark = BLOCK_CACHE_SLOTS * 3 / 4,
+	.lo_mark = BLOCK_CACHE_SLOTS / 4,
+};
+#if SD_USE_STRIPE
+static BlockDev stripe = BLOCK_STRIPE();
+static BlockDev stripe_cached = BLOCK_CACHE(&stripe, &drv0_cache);
+static BlockDev stripe_top = BLOCK_STATS(&stripe_cached, &drv0_stats);
+
+static BlockDev *const drive[FF_VOLUMES] = { &stripe_top, NULL };
+#else
+static BlockDev sd0 = BLOCK_SD(0);
+static BlockDev sd1 = BLOCK_SD(1);
+static BlockDev sd0_cached = BLOCK_CACHE(&sd0, &drv0_cache);
+static BlockDev sd0_top = BLOCK_STATS(&sd0_cached, &drv0_stats);
+static BlockDev sd1_top = BLOCK_STATS(&sd1, &drv1_stats);
+
+static BlockDev *const drive[FF_VOLUMES] = { &sd0_top, &sd1_top };
+#endif
 
 /* Private variables ---------------------------------------------------------*/
-/* Note: This is a single-threaded embedded system design with single SD card.
- * The is_initialized flag tracks initialization state and is only accessed from
- * main thread context (not from ISRs). The SD card driver handles its own
- * interrupt safety with volatile variables where needed. */
-static BYTE is_initialized = 0;
+/* Note: This is a single-threaded embedded system design, one SD card per drive.
+ * The is_initialized flags track initialization state per physical drive and are
+ * only accessed from main thread context (not from ISRs). The SD card driver
+ * handles its own interrupt safety with volatile variables where needed. */
+static BYTE is_initialized[FF_VOLUMES];
 
 /* Private functions ---------------------------------------------------------*/
 
@@ -26,9 +62,13 @@ static BYTE is_initialized = 0;
  */
 DSTATUS disk_status(BYTE pdrv /* Physical drive number to identify the drive */
 ) {
-	DSTATUS stat = SD_status(pdrv);
+	DSTATUS stat;
 
-	is_initialized = (stat == RES_OK);
+	if (pdrv >= FF_VOLUMES)
+		return STA_NOINIT;
+
+	stat = Block_Status(drive[pdrv]);
+	is_initialized[pdrv] = !(stat & STA_NOINIT);
 	return stat;
 }
 
@@ -39,10 +79,15 @@ DSTATUS disk_status(BYTE pdrv /* Physical drive number to identify the drive */
  */
 DSTATUS disk_initialize(BYTE pdrv /* Physical drive nmuber to identify the drive */
 ) {
-	DSTATUS stat = SD_status(pdrv);
-	if (!is_initialized || stat != RES_OK) {
-		stat = SD_SPI_Init(pdrv);
-		is_initialized = stat == RES_OK;
+	DSTATUS stat;
+
+	if (pdrv >= FF_VOLUMES)
+		return STA_NOINIT;
+
+	stat = Block_Status(drive[pdrv]);
+	if (!is_initialized[pdrv] || (stat & STA_NOINIT)) {
+		stat = Block_Init(drive[pdrv]); // Only the cards that are down are initialized
+		is_initialized[pdrv] = !(stat & STA_NOINIT);
 	}
 
 	return stat;
@@ -61,7 +106,9 @@ BYTE *buff, /* Data buffer to store read data */
 LBA_t sector, /* Sector address in LBA */
 UINT count /* Number of sectors to read */
 ) {
-	return SD_ReadBlocks(pdrv, buff, sector, count);
+	if (pdrv >= FF_VOLUMES)
+		return RES_PARERR;
+	return Block_Read(drive[pdrv], buff, sector, count);
 }
 
 /**
@@ -77,7 +124,9 @@ const BYTE *buff, /* Data to be written */
 LBA_t sector, /* Sector address in LBA */
 UINT count /* Number of sectors to write */
 ) {
-	return SD_WriteBlocks(pdrv, buff, sector, count);
+	if (pdrv >= FF_VOLUMES)
+		return RES_PARERR;
+	return Block_Write(drive[pdrv], buff, sector, count);
 }
 
 /**
@@ -91,5 +140,7 @@ DRESULT disk_ioctl(BYTE pdrv, /* Physical drive nmuber (0..) */
 BYTE cmd, /* Control code */
 void *buff /* Buffer to send/receive control data */
 ) {
-	return SD_ioctl(pdrv, cmd, buff);
+	if (pdrv >= FF_VOLUMES)
+		return RES_PARERR;
+	return Block_Ioctl(drive[pdrv], cmd, buff); // CTRL_SYNC flushes every layer
 }
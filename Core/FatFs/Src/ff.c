@@ -277,6 +277,36 @@
 #endif
 
 
+/* Deferred 2nd FAT mirroring */
+#if FF_FS_LAZYFAT < 0 || FF_FS_LAZYFAT == 1
+#error Wrong FF_FS_LAZYFAT setting
+#endif
+
+
+/* Deferred directory entry update on f_sync */
+#if FF_FS_LAZYSYNC < 0 || FF_FS_LAZYSYNC_SEC < 0
+#error Wrong FF_FS_LAZYSYNC setting
+#endif
+
+
+/* AU aligned allocation */
+#if FF_FS_AUALIGN < 0
+#error Wrong FF_FS_AUALIGN setting
+#endif
+
+
+/* exFAT allocation bitmap cache */
+#if FF_FS_BMCACHE < 0
+#error Wrong FF_FS_BMCACHE setting
+#endif
+
+
+/* Directory read-ahead */
+#if FF_FS_DIRBURST < 0 || FF_FS_DIRBURST == 1
+#error Wrong FF_FS_DIRBURST setting
+#endif
+
+
 /* File lock controls */
 #if FF_FS_LOCK
 #if FF_FS_READONLY
@@ -1050,6 +1080,141 @@ static void clear_share (	/* Clear all lock entries of the volume */
 
 
 
+#if FF_FS_EXFAT && !FF_FS_READONLY && FF_FS_BMCACHE
+/*-----------------------------------------------------------------------*/
+/* Write back the dirty sectors in the allocation bitmap cache           */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT sync_bitmap (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs		/* Filesystem object */
+)
+{
+	if (fs->bmdhi != 0) {	/* Write the dirty range in a multi-sector write */
+		if (disk_write(fs->pdrv, fs->sbuf + fs->bmdlo * SS(fs), fs->bmsect + fs->bmdlo, fs->bmdhi - fs->bmdlo) != RES_OK) return FR_DISK_ERR;
+		fs->bmdhi = 0;
+	}
+	return FR_OK;
+}
+#endif
+
+
+
+
+#if FF_SBUF_SECT
+/*-----------------------------------------------------------------------*/
+/* Take the scratch buffer over for a user                               */
+/*-----------------------------------------------------------------------*/
+/* The 2nd FAT copy, the allocation bitmap cache and the directory read-ahead
+/  share fs->sbuf[]. The read-ahead is only discarded, the bitmap cache is
+/  written back before it is discarded. */
+
+#define SBUF_FAT2	1	/* fs->sbuf_use: Bounce buffer of sync_fat2() */
+#define SBUF_BMAP	2	/* fs->sbuf_use: Allocation bitmap cache */
+#define SBUF_DIR	3	/* fs->sbuf_use: Directory read-ahead */
+
+static FRESULT take_sbuf (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	BYTE use		/* New user of the buffer */
+)
+{
+	if (fs->sbuf_use != use) {
+#if FF_SBUF_BM
+		if (fs->sbuf_use == SBUF_BMAP) {
+			if (sync_bitmap(fs) != FR_OK) return FR_DISK_ERR;
+			fs->n_bmsect = 0;
+		}
+#endif
+#if FF_SBUF_DIR
+		if (fs->sbuf_use == SBUF_DIR) fs->n_rasect = 0;
+#endif
+		fs->sbuf_use = use;
+	}
+	return FR_OK;
+}
+#endif
+
+
+
+
+#if !FF_FS_READONLY && FF_FS_LAZYFAT
+/*-----------------------------------------------------------------------*/
+/* Deferred 2nd FAT mirroring                                            */
+/*-----------------------------------------------------------------------*/
+/* The 1st FAT is written first and it is the only one FatFs reads. The 2nd FAT
+/  is brought up to date in sync_fs() and f_mount(), so that it always holds the
+/  allocation state at a sync point, never a state newer than the 1st FAT. */
+
+static void mark_fat2 (
+	FATFS* fs,		/* Filesystem object */
+	DWORD ofs		/* Sector offset in the 1st FAT written back */
+)
+{
+	DWORD (*run)[2] = fs->fat2run;
+	UINT i, n, g;
+	DWORD gap;
+
+
+	n = fs->n_fat2run;
+	for (i = 0; i < n && run[i][0] <= ofs; i++) ;	/* Find the first run after the sector */
+	if (i > 0 && ofs <= run[i - 1][0] + run[i - 1][1]) {	/* In or next to the preceding run? */
+		if (ofs == run[i - 1][0] + run[i - 1][1]) {
+			run[i - 1][1]++;		/* Extend the preceding run */
+			if (i < n && run[i - 1][0] + run[i - 1][1] == run[i][0]) {	/* Joined to the following run? */
+				run[i - 1][1] += run[i][1];
+				memmove(run[i], run[i + 1], (n - i - 1) * sizeof run[0]);
+				fs->n_fat2run = n - 1;
+			}
+		}
+		return;
+	}
+	if (i < n && ofs + 1 == run[i][0]) {	/* Next to the following run? */
+		run[i][0]--; run[i][1]++;
+		return;
+	}
+	if (n == FF_FS_LAZYFAT) {	/* Table full? Merge the pair of runs with the shortest gap */
+		for (gap = 0xFFFFFFFF, g = i = 1; i < n; i++) {
+			if (run[i][0] - run[i - 1][0] - run[i - 1][1] < gap) {
+				gap = run[i][0] - run[i - 1][0] - run[i - 1][1]; g = i;
+			}
+		}
+		run[g - 1][1] = run[g][0] + run[g][1] - run[g - 1][0];
+		memmove(run[g], run[g + 1], (n - g - 1) * sizeof run[0]);
+		fs->n_fat2run = n - 1;
+		mark_fat2(fs, ofs);		/* The sector may be in the merged run */
+		return;
+	}
+	memmove(run[i + 1], run[i], (n - i) * sizeof run[0]);	/* Insert a new run */
+	run[i][0] = ofs; run[i][1] = 1;
+	fs->n_fat2run = n + 1;
+}
+
+
+static FRESULT sync_fat2 (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs			/* Filesystem object */
+)
+{
+	UINT i, n;
+	DWORD ofs, cnt;
+
+
+	if (fs->n_fat2run == 0) return FR_OK;
+	if (take_sbuf(fs, SBUF_FAT2) != FR_OK) return FR_DISK_ERR;
+	for (i = 0; i < fs->n_fat2run; i++) {	/* Copy each run from the 1st FAT to the 2nd FAT */
+		ofs = fs->fat2run[i][0]; cnt = fs->fat2run[i][1];
+		do {
+			n = (cnt < sizeof fs->sbuf / SS(fs)) ? cnt : sizeof fs->sbuf / SS(fs);
+			if (disk_read(fs->pdrv, fs->sbuf, fs->fatbase + ofs, n) != RES_OK) return FR_DISK_ERR;
+			if (disk_write(fs->pdrv, fs->sbuf, fs->fatbase + fs->fsize + ofs, n) != RES_OK) return FR_DISK_ERR;
+			ofs += n; cnt -= n;
+		} while (cnt);
+	}
+	fs->n_fat2run = 0;
+	return FR_OK;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Move/Flush disk access window in the filesystem object                */
 /*-----------------------------------------------------------------------*/
@@ -1064,8 +1229,15 @@ static FRESULT sync_window (	/* Returns FR_OK or FR_DISK_ERR */
 	if (fs->wflag) {	/* Is the disk access window dirty? */
 		if (disk_write(fs->pdrv, fs->win, fs->winsect, 1) == RES_OK) {	/* Write it back into the volume */
 			fs->wflag = 0;	/* Clear window dirty flag */
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+			fs->n_rasect = 0;	/* Discard the directory read-ahead buffer on any change to the volume */
+#endif
 			if (fs->winsect - fs->fatbase < fs->fsize) {	/* Is it in the 1st FAT? */
+#if FF_FS_LAZYFAT
+				if (fs->n_fats == 2) mark_fat2(fs, (DWORD)(fs->winsect - fs->fatbase));	/* Reflect it to 2nd FAT at next sync */
+#else
 				if (fs->n_fats == 2) disk_write(fs->pdrv, fs->win, fs->winsect + fs->fsize, 1);	/* Reflect it to 2nd FAT if needed */
+#endif
 			}
 		} else {
 			res = FR_DISK_ERR;
@@ -1089,6 +1261,11 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 		res = sync_window(fs);		/* Flush the window */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+			if (sect - fs->rasect < fs->n_rasect) {	/* Is the sector in the read-ahead buffer? */
+				memcpy(fs->win, fs->sbuf + (sect - fs->rasect) * SS(fs), SS(fs));
+			} else
+#endif
 			if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
 				sect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
 				res = FR_DISK_ERR;
@@ -1111,10 +1288,19 @@ static FRESULT sync_fs (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS* fs		/* Filesystem object */
 )
 {
-	FRESULT res;
+	FRESULT res = FR_OK;
 
 
-	res = sync_window(fs);
+#if FF_FS_EXFAT && FF_FS_BMCACHE
+	res = sync_bitmap(fs);	/* Write back the allocation bitmap cache first */
+#endif
+#if FF_FS_LAZYFAT
+	if (res == FR_OK) res = sync_fat2(fs);	/* Bring the 2nd FAT up to the 1st FAT on the storage */
+#endif
+	if (res == FR_OK) res = sync_window(fs);
+#if FF_FS_LAZYFAT
+	if (res == FR_OK) res = sync_fat2(fs);	/* and to the FAT sector written from the window if any */
+#endif
 	if (res == FR_OK) {
 		if (fs->fsi_flag == 1) {	/* Allocation changed? */
 			fs->fsi_flag = 0;
@@ -1302,6 +1488,51 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 	return res;
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Link a run of contiguous clusters                        */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT put_fat_run (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* Corresponding filesystem object */
+	DWORD clst,		/* First cluster of the run */
+	DWORD ncl,		/* Number of clusters in the run */
+	DWORD term		/* Value to be set to the last entry */
+)
+{
+	UINT i, n;
+	DWORD val;
+	FRESULT res;
+
+
+	if (clst < 2 || clst + ncl > fs->n_fatent) return FR_INT_ERR;	/* Check if in valid range */
+	if (fs->fs_type == FS_FAT12) {		/* FAT12 entry can straddle sectors, link it an entry at a time */
+		for ( ; ncl; clst++, ncl--) {
+			res = put_fat(fs, clst, (ncl > 1) ? clst + 1 : term);
+			if (res != FR_OK) return res;
+		}
+		return FR_OK;
+	}
+	n = SS(fs) / ((fs->fs_type == FS_FAT16) ? 2 : 4);	/* Number of entries in a sector */
+	while (ncl) {
+		res = move_window(fs, fs->fatbase + clst / n);
+		if (res != FR_OK) return res;
+		for (i = clst % n; i < n && ncl; i++, clst++, ncl--) {	/* Fill the entries in the sector */
+			val = (ncl > 1) ? clst + 1 : term;
+			if (fs->fs_type == FS_FAT16) {
+				st_16(fs->win + i * 2, (WORD)val);
+			} else {
+				if (fs->fs_type == FS_FAT32) val = (val & 0x0FFFFFFF) | (ld_32(fs->win + i * 4) & 0xF0000000);
+				st_32(fs->win + i * 4, val);
+			}
+		}
+		fs->wflag = 1;
+	}
+	return FR_OK;
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -1312,6 +1543,72 @@ static FRESULT put_fat (	/* FR_OK(0):succeeded, !=0:error */
 /* exFAT: Accessing FAT and Allocation Bitmap                            */
 /*-----------------------------------------------------------------------*/
 
+/*-----------------------------------------*/
+/* Get the pointer to a byte of the bitmap */
+/*-----------------------------------------*/
+
+static BYTE* bitmap_ptr (	/* Pointer to the byte in the cache, 0:disk error */
+	FATFS* fs,	/* Filesystem object */
+	DWORD ofs,	/* Byte offset in the allocation bitmap */
+	UINT* nb	/* Number of bytes available in the cache from the byte */
+)
+{
+#if FF_FS_BMCACHE
+	DWORD top;
+	UINT n;
+
+
+	top = ofs / SS(fs) / FF_FS_BMCACHE * FF_FS_BMCACHE;	/* Top sector of the cache window in the bitmap */
+	if (fs->n_bmsect == 0 || fs->bmsect != fs->bitbase + top) {	/* Not in the cache? */
+		if (sync_bitmap(fs) != FR_OK) return 0;
+		n = (UINT)((fs->n_fatent - 2 + SS(fs) * 8 - 1) / (SS(fs) * 8) - top);	/* Bitmap sectors from the window */
+		if (n > FF_FS_BMCACHE) n = FF_FS_BMCACHE;
+		fs->n_bmsect = 0;
+		if (take_sbuf(fs, SBUF_BMAP) != FR_OK) return 0;
+		if (disk_read(fs->pdrv, fs->sbuf, fs->bitbase + top, n) != RES_OK) return 0;
+		fs->bmsect = fs->bitbase + top;
+		fs->n_bmsect = n;
+	}
+	ofs -= top * SS(fs);
+	*nb = fs->n_bmsect * SS(fs) - ofs;
+	return fs->sbuf + ofs;
+#else
+	if (move_window(fs, fs->bitbase + ofs / SS(fs)) != FR_OK) return 0;
+	*nb = SS(fs) - ofs % SS(fs);
+	return fs->win + ofs % SS(fs);
+#endif
+}
+
+
+/*--------------------------------------------*/
+/* Mark the bytes of the bitmap to be written */
+/*--------------------------------------------*/
+
+static void mark_bitmap (
+	FATFS* fs,	/* Filesystem object */
+	DWORD ofs,	/* Byte offset in the allocation bitmap (in the cache) */
+	UINT nb		/* Number of bytes changed (1..) */
+)
+{
+#if FF_FS_BMCACHE
+	UINT lo, hi;
+
+
+	lo = (UINT)(ofs / SS(fs) - (fs->bmsect - fs->bitbase));	/* Changed sectors in the cache window */
+	hi = (UINT)((ofs + nb - 1) / SS(fs) - (fs->bmsect - fs->bitbase)) + 1;
+	if (fs->bmdhi == 0) {	/* Clean? */
+		fs->bmdlo = lo; fs->bmdhi = hi;
+	} else {				/* Merge into the dirty range */
+		if (lo < fs->bmdlo) fs->bmdlo = lo;
+		if (hi > fs->bmdhi) fs->bmdhi = hi;
+	}
+#else
+	(void)ofs; (void)nb;
+	fs->wflag = 1;
+#endif
+}
+
+
 /*--------------------------------------*/
 /* Find a contiguous free cluster block */
 /*--------------------------------------*/
@@ -1322,33 +1619,52 @@ static DWORD find_bitmap (	/* 0:Not found, 2..:Cluster block found, 0xFFFFFFFF:D
 	DWORD ncl	/* Number of contiguous clusters to find (1..) */
 )
 {
-	BYTE bm, bv;
-	UINT i;
-	DWORD val, scl, ctr;
+	BYTE bm, *bp;
+	UINT nb, w;
+	DWORD nbit, val, scl, ctr, left, wd;
 
 
+	nbit = fs->n_fatent - 2;	/* Number of bits in the bitmap */
 	clst -= 2;	/* The first bit in the bitmap corresponds to cluster #2 */
-	if (clst >= fs->n_fatent - 2) clst = 0;
-	scl = val = clst; ctr = 0;
-	for (;;) {
-		if (move_window(fs, fs->bitbase + val / 8 / SS(fs)) != FR_OK) return 0xFFFFFFFF;
-		i = val / 8 % SS(fs); bm = 1 << (val % 8);
-		do {
-			do {
-				bv = fs->win[i] & bm; bm <<= 1;		/* Get bit value */
-				if (++val >= fs->n_fatent - 2) {	/* Next cluster (with wrap-around) */
-					val = 0; bm = 0; i = SS(fs);
+	if (clst >= nbit) clst = 0;
+	scl = val = clst; ctr = 0; left = nbit;
+	while (left) {
+		bp = bitmap_ptr(fs, val / 8, &nb);
+		if (!bp) return 0xFFFFFFFF;
+		for ( ; nb && left; bp++, nb--) {
+			if (val % 8 == 0 && left >= 8 && nbit - val >= 8) {	/* Check whole bytes at a time if possible */
+				w = (val % 32 == 0 && nb >= 4 && left >= 32 && nbit - val >= 32) ? 4 : 1;	/* A word or a byte */
+				wd = (w == 4) ? ld_32(bp) : (*bp == 0xFF) ? 0xFFFFFFFF : *bp;
+				if (wd == 0) {				/* All free? */
+					if (ctr + w * 8 >= ncl) return scl + 2;	/* Check if run length is sufficient for required */
+					ctr += w * 8;
+				}
+				if (wd == 0xFFFFFFFF) {		/* All in use? */
+					scl = val + w * 8; ctr = 0;
+				}
+				if (wd == 0 || wd == 0xFFFFFFFF) {
+					val += w * 8; left -= w * 8;
+					bp += w - 1; nb -= w - 1;
+					if (val >= nbit) break;
+					continue;
 				}
-				if (bv == 0) {	/* Is it a free cluster? */
+			}
+			bm = 1 << (val % 8);
+			do {
+				if (*bp & bm) {		/* Encountered a cluster in-use, restart to scan */
+					scl = val + 1; ctr = 0;
+				} else {			/* Is it a free cluster? */
 					if (++ctr == ncl) return scl + 2;	/* Check if run length is sufficient for required */
-				} else {
-					scl = val; ctr = 0;		/* Encountered a cluster in-use, restart to scan */
 				}
-				if (val == clst) return 0;	/* All cluster scanned? */
-			} while (bm != 0);
-			bm = 1;
-		} while (++i < SS(fs));
+				val++; left--;
+			} while ((bm <<= 1) != 0 && left && val < nbit);
+			if (val >= nbit) break;
+		}
+		if (val >= nbit) {	/* Wrap-around (a block cannot straddle the end) */
+			val = scl = 0; ctr = 0;
+		}
 	}
+	return 0;	/* All cluster scanned */
 }
 
 
@@ -1363,28 +1679,33 @@ static FRESULT change_bitmap (
 	int bv		/* bit value to be set (0 or 1) */
 )
 {
-	BYTE bm;
-	UINT i;
-	LBA_t sect;
+	BYTE bm, *bp;
+	UINT nb, i;
+	DWORD ofs;
 
 
 	clst -= 2;	/* The first bit corresponds to cluster #2 */
-	sect = fs->bitbase + clst / 8 / SS(fs);	/* Sector address */
-	i = clst / 8 % SS(fs);					/* Byte offset in the sector */
-	bm = 1 << (clst % 8);					/* Bit mask in the byte */
-	for (;;) {
-		if (move_window(fs, sect++) != FR_OK) return FR_DISK_ERR;
-		do {
+	while (ncl) {
+		ofs = clst / 8;		/* Byte offset in the bitmap */
+		bp = bitmap_ptr(fs, ofs, &nb);
+		if (!bp) return FR_DISK_ERR;
+		for (i = 0; i < nb && ncl; i++) {
+			bm = 1 << (clst % 8);					/* Bit mask in the byte */
+			if (bm == 1 && ncl >= 8) {	/* Process a whole byte at a time */
+				if (bp[i] != (bv ? 0x00 : 0xFF)) return FR_INT_ERR;	/* Are the bits expected value? */
+				bp[i] = bv ? 0xFF : 0x00;
+				clst += 8; ncl -= 8;
+				continue;
+			}
 			do {
-				if (bv == (int)((fs->win[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
-				fs->win[i] ^= bm;	/* Flip the bit */
-				fs->wflag = 1;
-				if (--ncl == 0) return FR_OK;	/* All bits processed? */
-			} while (bm <<= 1);		/* Next bit */
-			bm = 1;
-		} while (++i < SS(fs));		/* Next byte */
-		i = 0;
+				if (bv == (int)((bp[i] & bm) != 0)) return FR_INT_ERR;	/* Is the bit expected value? */
+				bp[i] ^= bm;	/* Flip the bit */
+				clst++;
+			} while (--ncl && (bm <<= 1) != 0);	/* Next bit */
+		}
+		mark_bitmap(fs, ofs, i);	/* Mark the bytes changed in this window */
 	}
+	return FR_OK;
 }
 
 
@@ -1397,12 +1718,11 @@ static FRESULT fill_first_frag (
 )
 {
 	FRESULT res;
-	DWORD cl, n;
 
 
 	if (obj->stat == 3) {	/* Has the object been changed 'fragmented' in this session? */
-		for (cl = obj->sclust, n = obj->n_cont; n; cl++, n--) {	/* Create cluster chain on the FAT */
-			res = put_fat(obj->fs, cl, cl + 1);
+		if (obj->n_cont) {	/* Create cluster chain on the FAT */
+			res = put_fat_run(obj->fs, obj->sclust, obj->n_cont, obj->sclust + obj->n_cont);
 			if (res != FR_OK) return res;
 		}
 		obj->stat = 0;	/* Change status 'FAT chain is valid' */
@@ -1424,10 +1744,10 @@ static FRESULT fill_last_frag (
 	FRESULT res;
 
 
-	while (obj->n_frag > 0) {	/* Create the chain of last fragment */
-		res = put_fat(obj->fs, lcl - obj->n_frag + 1, (obj->n_frag > 1) ? lcl - obj->n_frag + 2 : term);
+	if (obj->n_frag > 0) {	/* Create the chain of last fragment */
+		res = put_fat_run(obj->fs, lcl - obj->n_frag + 1, obj->n_frag, term);
 		if (res != FR_OK) return res;
-		obj->n_frag--;
+		obj->n_frag = 0;
 	}
 	return FR_OK;
 }
@@ -1440,6 +1760,63 @@ static FRESULT fill_last_frag (
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Remove a cluster chain                                 */
 /*-----------------------------------------------------------------------*/
+/* The freed clusters are collected while the chain is followed and then
+/  released in ascending order, so that each FAT (or bitmap) sector is written
+/  once per batch even if the chain is fragmented across the sectors. */
+
+#define FREE_BATCH	64	/* Size of the batch table (FAT entries, or twice the bitmap runs on exFAT) */
+
+static LBA_t fat_sect (	/* FAT sector holding the entry */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clst		/* Cluster number */
+)
+{
+	switch (fs->fs_type) {
+	case FS_FAT12 :
+		return fs->fatbase + (clst + clst / 2) / SS(fs);
+	case FS_FAT16 :
+		return fs->fatbase + clst / (SS(fs) / 2);
+	}
+	return fs->fatbase + clst / (SS(fs) / 4);
+}
+
+
+static FRESULT free_batch (	/* FR_OK(0):succeeded, !=0:error */
+	FATFS* fs,		/* Filesystem object */
+	DWORD* tbl,		/* FAT: cluster numbers, exFAT: {start cluster, number of clusters} pairs */
+	UINT n			/* Number of items in the table */
+)
+{
+	FRESULT res;
+	UINT i, j, w = (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) ? 2 : 1;	/* Item width in DWORD */
+	DWORD cl, nc;
+
+
+	for (i = w; i < n * w; i += w) {	/* Sort the items in ascending order (insertion sort, it is mostly sorted) */
+		cl = tbl[i]; nc = tbl[i + w - 1];
+		for (j = i; j > 0 && tbl[j - w] > cl; j -= w) {
+			tbl[j] = tbl[j - w]; tbl[j + w - 1] = tbl[j - 1];
+		}
+		tbl[j] = cl; tbl[j + w - 1] = nc;
+	}
+	for (i = 0; i < n * w; i += w) {
+#if FF_FS_EXFAT
+		if (w == 2) {
+			res = change_bitmap(fs, tbl[i], tbl[i + 1], 0);	/* Mark the cluster block 'free' on the bitmap */
+		} else
+#endif
+		{
+			res = put_fat(fs, tbl[i], 0);	/* Mark the cluster 'free' on the FAT */
+		}
+		if (res != FR_OK) return res;
+		if (fs->free_clst < fs->n_fatent - 2) {	/* Update allocation information if it is valid */
+			fs->free_clst += (w == 2) ? tbl[i + 1] : 1;	/* Count the clusters only when they are freed */
+			fs->fsi_flag |= 1;
+		}
+	}
+	return FR_OK;
+}
+
 
 static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	FFOBJID* obj,		/* Corresponding object */
@@ -1450,6 +1827,8 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res = FR_OK;
 	DWORD nxt;
 	FATFS *fs = obj->fs;
+	DWORD tbl[FREE_BATCH];
+	UINT n = 0;
 #if FF_FS_EXFAT || FF_USE_TRIM
 	DWORD scl = clst, ecl = clst;
 #endif
@@ -1467,17 +1846,24 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 
 	/* Remove the chain */
 	do {
+		if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
+			if (n > 0 && fs->wflag && fat_sect(fs, clst) != fs->winsect) {	/* Release the batch before the dirty window is flushed */
+				res = free_batch(fs, tbl, n);
+				if (res != FR_OK) return res;
+				n = 0;
+			}
+		}
 		nxt = get_fat(obj, clst);			/* Get cluster status */
 		if (nxt == 0) break;				/* Empty cluster? */
 		if (nxt == 1) return FR_INT_ERR;	/* Internal error? */
 		if (nxt == 0xFFFFFFFF) return FR_DISK_ERR;	/* Disk error? */
 		if (!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) {
-			res = put_fat(fs, clst, 0);		/* Mark the cluster 'free' on the FAT */
-			if (res != FR_OK) return res;
-		}
-		if (fs->free_clst < fs->n_fatent - 2) {	/* Update allocation information if it is valid */
-			fs->free_clst++;
-			fs->fsi_flag |= 1;
+			tbl[n++] = clst;				/* Mark the cluster 'free' on the FAT later */
+			if (n == FREE_BATCH) {
+				res = free_batch(fs, tbl, n);
+				if (res != FR_OK) return res;
+				n = 0;
+			}
 		}
 #if FF_FS_EXFAT || FF_USE_TRIM
 		if (ecl + 1 == nxt) {	/* Is next cluster contiguous? */
@@ -1485,8 +1871,12 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 		} else {				/* End of contiguous cluster block */
 #if FF_FS_EXFAT
 			if (fs->fs_type == FS_EXFAT) {
-				res = change_bitmap(fs, scl, ecl - scl + 1, 0);	/* Mark the cluster block 'free' on the bitmap */
-				if (res != FR_OK) return res;
+				tbl[n * 2] = scl; tbl[n * 2 + 1] = ecl - scl + 1;	/* Mark the cluster block 'free' on the bitmap later */
+				if (++n == FREE_BATCH / 2) {
+					res = free_batch(fs, tbl, n);
+					if (res != FR_OK) return res;
+					n = 0;
+				}
 			}
 #endif
 #if FF_USE_TRIM
@@ -1500,6 +1890,11 @@ static FRESULT remove_chain (	/* FR_OK(0):succeeded, !=0:error */
 		clst = nxt;					/* Next cluster */
 	} while (clst < fs->n_fatent);	/* Repeat until the last link */
 
+	if (n > 0) {	/* Release the rest of the batch */
+		res = free_batch(fs, tbl, n);
+		if (res != FR_OK) return res;
+	}
+
 #if FF_FS_EXFAT
 	/* Some post processes for chain status */
 	if (fs->fs_type == FS_EXFAT) {
@@ -1585,122 +1980,537 @@ static DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:D
 		}
 	} else
 #endif
-	{	/* On the FAT/FAT32 volume */
-		ncl = 0;
-		if (scl == clst) {						/* Stretching an existing chain? */
-			ncl = scl + 1;						/* Test if next cluster is free */
-			if (ncl >= fs->n_fatent) ncl = 2;
-			cs = get_fat(obj, ncl);				/* Get next cluster status */
-			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
-			if (cs != 0) {						/* Not free? */
-				cs = fs->last_clst;				/* Start at suggested cluster if it is valid */
-				if (cs >= 2 && cs < fs->n_fatent) scl = cs;
-				ncl = 0;
-			}
-		}
-		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
-			ncl = scl;	/* Start cluster */
-			for (;;) {
-				ncl++;							/* Next cluster */
-				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
-					ncl = 2;
-					if (ncl > scl) return 0;	/* No free cluster found? */
-				}
-				cs = get_fat(obj, ncl);			/* Get the cluster status */
-				if (cs == 0) break;				/* Found a free cluster? */
-				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
-				if (ncl == scl) return 0;		/* No free cluster found? */
-			}
-		}
-		res = put_fat(fs, ncl, 0xFFFFFFFF);		/* Mark the new cluster 'EOC' */
-		if (res == FR_OK && clst != 0) {
-			res = put_fat(fs, clst, ncl);		/* Link it from the previous one if needed */
+	{	/* On the FAT/FAT32 volume */
+		ncl = 0;
+		if (scl == clst) {						/* Stretching an existing chain? */
+			ncl = scl + 1;						/* Test if next cluster is free */
+			if (ncl >= fs->n_fatent) ncl = 2;
+			cs = get_fat(obj, ncl);				/* Get next cluster status */
+			if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+			if (cs != 0) {						/* Not free? */
+				cs = fs->last_clst;				/* Start at suggested cluster if it is valid */
+				if (cs >= 2 && cs < fs->n_fatent) scl = cs;
+				ncl = 0;
+			}
+		}
+		if (ncl == 0) {	/* The new cluster cannot be contiguous and find another fragment */
+			ncl = scl;	/* Start cluster */
+			for (;;) {
+				ncl++;							/* Next cluster */
+				if (ncl >= fs->n_fatent) {		/* Check wrap-around */
+					ncl = 2;
+					if (ncl > scl) return 0;	/* No free cluster found? */
+				}
+				cs = get_fat(obj, ncl);			/* Get the cluster status */
+				if (cs == 0) break;				/* Found a free cluster? */
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;	/* Test for error */
+				if (ncl == scl) return 0;		/* No free cluster found? */
+			}
+		}
+		res = put_fat(fs, ncl, 0xFFFFFFFF);		/* Mark the new cluster 'EOC' */
+		if (res == FR_OK && clst != 0) {
+			res = put_fat(fs, clst, ncl);		/* Link it from the previous one if needed */
+		}
+	}
+
+	if (res == FR_OK) {			/* Update allocation information if the function succeeded */
+		fs->last_clst = ncl;
+		if (fs->free_clst > 0 && fs->free_clst <= fs->n_fatent - 2) {
+			fs->free_clst--;
+			fs->fsi_flag |= 1;
+		}
+	} else {
+		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
+	}
+
+	return ncl;		/* Return new cluster number or error status */
+}
+
+
+
+
+#if FF_FS_AUALIGN
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Find a block of free allocation units                  */
+/*-----------------------------------------------------------------------*/
+
+static DWORD find_au (	/* 0:Not found, 2..:First cluster of the block, 1:Internal error, 0xFFFFFFFF:Disk error */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst,			/* Cluster# to start to find */
+	DWORD ncl			/* Number of clusters wanted (rounded up to whole AUs) */
+)
+{
+	DWORD au, scl, stcl, n, cs;
+	UINT tries = 0;
+	BYTE wrap = 0;
+	FATFS *fs = obj->fs;
+
+
+	au = fs->au_clst;
+	ncl = (ncl + au - 1) / au * au;
+	if (clst >= fs->n_fatent) clst = 2;	/* Invalid suggestion? */
+	stcl = (clst < fs->au_top) ? fs->au_top : fs->au_top + (clst - fs->au_top + au - 1) / au * au;	/* AU boundary to start */
+	scl = stcl;
+	for (;;) {
+		if (scl + ncl > fs->n_fatent || (wrap && scl >= stcl)) {	/* End of the scan? */
+			if (wrap || stcl == fs->au_top) return 0;
+			scl = fs->au_top; wrap = 1;	/* Wrap around to the first AU */
+			continue;
+		}
+		if (++tries > FF_FS_AUALIGN) return 0;	/* Tried as many AU boundaries as allowed? */
+		for (n = 0; n < ncl; n++) {		/* Check if the clusters are all free */
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				BYTE *bp;
+				UINT nb;
+
+				cs = scl + n - 2;				/* Bit offset in the bitmap */
+				bp = bitmap_ptr(fs, cs / 8, &nb);
+				if (!bp) return 0xFFFFFFFF;
+				if (*bp & (1 << (cs % 8))) break;	/* In use? */
+			} else
+#endif
+			{
+				cs = get_fat(obj, scl + n);
+				if (cs == 1 || cs == 0xFFFFFFFF) return cs;
+				if (cs != 0) break;				/* In use? */
+			}
+		}
+		if (n == ncl) return scl;		/* Found */
+		scl += (n / au + 1) * au;		/* Next AU boundary after the cluster in use */
+	}
+}
+
+#endif /* FF_FS_AUALIGN */
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch a chain by a run of clusters                   */
+/*-----------------------------------------------------------------------*/
+
+static DWORD create_chain_run (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:First cluster# of the run */
+	FFOBJID* obj,		/* Corresponding object */
+	DWORD clst,			/* Cluster# to stretch, 0:Create a new chain */
+	DWORD* ncl			/* Number of clusters wanted (in), clusters allocated (out, 0:followed the existing chain) */
+)
+{
+	DWORD scl, n, cs;
+	FRESULT res;
+	FATFS *fs = obj->fs;
+
+
+	if (clst != 0) {	/* Stretch a chain */
+		cs = get_fat(obj, clst);			/* Check the cluster status */
+		if (cs < 2) return 1;				/* Test for insanity */
+		if (cs == 0xFFFFFFFF) return cs;	/* Test for disk error */
+		if (cs < fs->n_fatent) {			/* It is already followed by next cluster */
+			*ncl = 0; return cs;
+		}
+	}
+#if FF_FS_AUALIGN
+	if (clst == 0 && fs->au_clst > 1 && *ncl >= fs->au_clst) {	/* Start a large chain on an AU boundary if possible */
+		scl = find_au(obj, fs->last_clst, *ncl);
+		if (scl == 1 || scl == 0xFFFFFFFF) return scl;
+		if (scl >= 2) fs->last_clst = (FF_FS_EXFAT && fs->fs_type == FS_EXFAT) ? scl : scl - 1;	/* Where create_chain() tries first */
+	}
+#endif
+	scl = create_chain(obj, clst);			/* Allocate the first cluster in the regular way */
+	if (scl < 2 || scl == 0xFFFFFFFF) return scl;
+
+	for (n = 1; n < *ncl && scl + n < fs->n_fatent; n++) {	/* Count the free clusters following it */
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT) {
+			BYTE *bp;
+			UINT nb;
+
+			cs = scl + n - 2;				/* Bit offset in the bitmap */
+			bp = bitmap_ptr(fs, cs / 8, &nb);
+			if (!bp) return 0xFFFFFFFF;
+			if (*bp & (1 << (cs % 8))) break;	/* In use? */
+		} else
+#endif
+		{
+			cs = get_fat(obj, scl + n);
+			if (cs == 1 || cs == 0xFFFFFFFF) return cs;
+			if (cs != 0) break;				/* In use? */
+		}
+	}
+	*ncl = n;
+	if (--n == 0) return scl;				/* No following free cluster */
+
+#if FF_FS_EXFAT
+	if (fs->fs_type == FS_EXFAT) {
+		res = change_bitmap(fs, scl + 1, n, 1);	/* Mark the clusters 'in use' */
+		if (obj->stat != 2) obj->n_frag += n;	/* Stretch the last fragment (it is put on the FAT later) */
+	} else
+#endif
+	{
+		res = put_fat_run(fs, scl, n + 1, 0xFFFFFFFF);	/* Link the clusters from the first one */
+	}
+	if (res != FR_OK) return (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;
+	fs->last_clst = scl + n;
+	if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
+		fs->free_clst -= n;
+		fs->fsi_flag |= 1;
+	}
+	return scl;
+}
+
+#endif /* !FF_FS_READONLY */
+
+
+
+
+#if FF_USE_FASTSEEK
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Convert offset into cluster with link map table        */
+/*-----------------------------------------------------------------------*/
+
+static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t ofs		/* File offset to be converted to cluster# */
+)
+{
+	DWORD cl, ncl;
+	DWORD *tbl;
+	FATFS *fs = fp->obj.fs;
+
+
+	tbl = fp->cltbl + 1;	/* Top of CLMT */
+	cl = (DWORD)(ofs / SS(fs) / fs->csize);	/* Cluster order from top of the file */
+	for (;;) {
+		ncl = *tbl++;			/* Number of cluters in the fragment */
+		if (ncl == 0) return 0;	/* End of table? (error) */
+		if (cl < ncl) break;	/* In this fragment? */
+		cl -= ncl; tbl++;		/* Next fragment */
+	}
+	return cl + *tbl;	/* Return the cluster number */
+}
+
+#endif	/* FF_USE_FASTSEEK */
+
+
+
+
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+/*-----------------------------------------------------------------------*/
+/* File write-behind buffer - Flush the buffered sectors                 */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT flush_wbuf (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp		/* Pointer to the file object */
+)
+{
+	if (fp->n_wbsect > 0) {	/* Write the buffered sectors in a multi-sector write */
+		if (disk_write(fp->obj.fs->pdrv, fp->wbuf, fp->wbsect, fp->n_wbsect) != RES_OK) return FR_DISK_ERR;
+		fp->n_wbsect = 0;
+	}
+	return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* File write-behind buffer - Put the dirty sector cache                 */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT put_wbuf (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp		/* Pointer to the file object with dirty sector cache */
+)
+{
+	FATFS *fs = fp->obj.fs;
+
+
+	if (!fp->wbuf) {	/* No write-behind buffer? */
+		return (disk_write(fs->pdrv, fp->buf, fp->sect, 1) == RES_OK) ? FR_OK : FR_DISK_ERR;
+	}
+	if (fp->n_wbsect > 0 && fp->sect != fp->wbsect + fp->n_wbsect) {	/* Not contiguous to the buffered sectors? */
+		if (flush_wbuf(fp) != FR_OK) return FR_DISK_ERR;
+	}
+	if (fp->n_wbsect == 0) fp->wbsect = fp->sect;	/* Start a new run */
+	memcpy(fp->wbuf + fp->n_wbsect * SS(fs), fp->buf, SS(fs));
+	fp->n_wbsect++;
+	return (fp->n_wbsect == fp->sz_wbuf) ? flush_wbuf(fp) : FR_OK;	/* Flush it when full */
+}
+
+#endif	/* !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF */
+
+
+
+
+#if !FF_FS_READONLY && FF_FS_LAZYSYNC
+/*-----------------------------------------------------------------------*/
+/* Check if the directory entry update can be deferred                   */
+/*-----------------------------------------------------------------------*/
+
+/* A deferred sync leaves a size checkpoint in the last SZ_SZCHK bytes of the
+/  sector holding the end of the file, which the sync writes anyway. It is
+/  overwritten by the data when the file grows over it, and f_recover() takes
+/  the size from the one that is left, if any. */
+
+#define SZ_SZCHK		20			/* Size of the size checkpoint */
+#define SZCHK_Sig		0			/* Signature "SZCK" (DWORD) */
+#define SZCHK_SizeL		4			/* File size, lower 32 bits (DWORD) */
+#define SZCHK_SizeH		8			/* File size, upper 32 bits (DWORD) */
+#define SZCHK_DirSize	12			/* File size in the directory entry at the checkpoint, lower 32 bits (DWORD) */
+#define SZCHK_FstClus	16			/* First cluster of the file (DWORD) */
+#define SZCHK_SIG		0x4B435A53	/* "SZCK" */
+
+static int defer_dir (	/* 1:Can be deferred, 0:Needs to be updated now */
+	FIL* fp		/* Pointer to the file object to be synced */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	DWORD bcs;
+	UINT ofs;
+	BYTE *buf, chk[SZ_SZCHK];
+
+
+	if (++fp->n_sync >= FF_FS_LAZYSYNC) return 0;	/* Deferred too many times? */
+	if (fp->obj.sclust != fp->dir_sclust || fp->obj.objsize < fp->dir_size) return 0;	/* Reallocated or shrunk? */
+	bcs = (DWORD)fs->csize * SS(fs);
+	if ((fp->obj.objsize + bcs - 1) / bcs != (fp->dir_size + bcs - 1) / bcs) return 0;	/* Crossed a cluster boundary? */
+#if FF_FS_LAZYSYNC_SEC
+	if (FF_FS_LAZYSYNC_TICK() - fp->dir_tick >= FF_FS_LAZYSYNC_SEC * 1000UL) return 0;	/* Interval elapsed? */
+#endif
+
+	/* The sector buffer must hold the end of the file with room for the checkpoint after it */
+	ofs = (UINT)(fp->obj.objsize % SS(fs));
+	if (fp->fptr != fp->obj.objsize || ofs == 0 || ofs > SS(fs) - SZ_SZCHK) return 0;
+	if (fp->sect != clst2sect(fs, fp->clust) + (UINT)(fp->fptr / SS(fs) & (fs->csize - 1))) return 0;
+#if FF_FS_TINY
+	if (fs->winsect != fp->sect) return 0;
+	buf = fs->win;
+#else
+	buf = fp->buf;
+#endif
+	st_32(chk + SZCHK_Sig, SZCHK_SIG);
+	st_32(chk + SZCHK_SizeL, (DWORD)fp->obj.objsize);
+	st_32(chk + SZCHK_SizeH, (DWORD)(fp->obj.objsize >> 16 >> 16));
+	st_32(chk + SZCHK_DirSize, (DWORD)fp->dir_size);
+	st_32(chk + SZCHK_FstClus, fp->obj.sclust);
+	if (memcmp(buf + SS(fs) - SZ_SZCHK, chk, SZ_SZCHK)) {	/* Not written yet? */
+		memcpy(buf + SS(fs) - SZ_SZCHK, chk, SZ_SZCHK);
+#if FF_FS_TINY
+		fs->wflag = 1;
+#else
+		fp->flag |= FA_DIRTY;
+#endif
+	}
+	return 1;
+}
+#endif
+
+
+
+
+#if FF_USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Get the contiguous extent of the file                                 */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT get_extent (	/* FR_OK(0):contiguous, FR_DENIED:fragmented, !=0:error */
+	FIL* fp		/* Pointer to the file object (allocation information is loaded) */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	DWORD bcs, ncl, clst, nxt;
+
+
+	fp->n_ctg = 0;
+	bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+	ncl = (DWORD)((fp->obj.objsize + bcs - 1) / bcs);	/* Number of clusters of the file */
+	if (fp->obj.sclust == 0 || ncl == 0) return FR_OK;	/* No cluster */
+#if FF_FS_EXFAT
+	if (fs->fs_type != FS_EXFAT || fp->obj.stat != 2)	/* Contiguous file on the exFAT volume needs no check */
+#endif
+	{
+		for (clst = fp->obj.sclust; clst < fp->obj.sclust + ncl - 1; clst = nxt) {	/* Check the cluster chain */
+			nxt = get_fat(&fp->obj, clst);
+			if (nxt == 0xFFFFFFFF) return FR_DISK_ERR;
+			if (nxt != clst + 1) return FR_DENIED;	/* Fragmented */
 		}
 	}
+	fp->n_ctg = ncl;
+	return FR_OK;
+}
+#endif
 
-	if (res == FR_OK) {			/* Update allocation information if the function succeeded */
-		fs->last_clst = ncl;
-		if (fs->free_clst > 0 && fs->free_clst <= fs->n_fatent - 2) {
-			fs->free_clst--;
-			fs->fsi_flag |= 1;
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Count contiguous sectors of the file                                  */
+/*-----------------------------------------------------------------------*/
+
+static UINT run_sect (	/* Number of contiguous sectors (clipped by nmax) */
+	FIL* fp,		/* Pointer to the file object */
+	DWORD clst,		/* Cluster of the top sector */
+	UINT n,			/* Sectors to the end of the cluster */
+	FSIZE_t nmax	/* Maximum number of sectors to be counted */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	DWORD nxt;
+
+
+#if FF_USE_EXPAND
+	if (clst - fp->obj.sclust < fp->n_ctg) {	/* In the contiguous extent? */
+		nxt = fp->n_ctg - 1 - (clst - fp->obj.sclust);	/* Clusters following in the extent */
+		if (n < nmax) {
+			if ((FSIZE_t)nxt * fs->csize > nmax - n) nxt = (DWORD)((nmax - n + fs->csize - 1) / fs->csize);
+			clst += nxt; n += nxt * fs->csize;
 		}
-	} else {
-		ncl = (res == FR_DISK_ERR) ? 0xFFFFFFFF : 1;	/* Failed. Generate error status */
 	}
-
-	return ncl;		/* Return new cluster number or error status */
+#endif
+	for ( ; n < nmax; clst = nxt, n += fs->csize) {	/* Extend it over the contiguous clusters */
+#if FF_FS_EXFAT
+		if (fs->fs_type == FS_EXFAT && fp->obj.stat == 2) {	/* Contiguous file on the exFAT volume */
+			nxt = clst + 1;
+		} else
+#endif
+		{
+			nxt = get_fat(&fp->obj, clst);
+		}
+		if (nxt != clst + 1 || nxt >= fs->n_fatent) break;	/* End of the contiguous run (or error) */
+	}
+	return (n > nmax) ? (UINT)nmax : n;
 }
 
-#endif /* !FF_FS_READONLY */
 
 
 
+#if !FF_FS_TINY && FF_USE_RBUF
+/*-----------------------------------------------------------------------*/
+/* File read-ahead buffer - Load a sector into the sector cache          */
+/*-----------------------------------------------------------------------*/
 
-#if FF_USE_FASTSEEK
+static FRESULT load_rbuf (	/* FR_OK(0):succeeded, !=0:error */
+	FIL* fp,		/* Pointer to the file object (fptr is on the sector to load) */
+	LBA_t sect,		/* Sector to be loaded into fp->buf[] */
+	UINT csect		/* Sector offset of the sector in the cluster */
+)
+{
+	FATFS *fs = fp->obj.fs;
+	FSIZE_t nrem;
+	UINT n;
+
+
+	if (fp->rbuf && sect - fp->rbsect >= fp->n_rbsect) {	/* Not in the read-ahead buffer? */
+		fp->n_rbsect = 0;
+		nrem = (fp->obj.objsize - fp->fptr + SS(fs) - 1) / SS(fs);	/* Sectors to the end of the file */
+		if (nrem > fp->rbwin) nrem = fp->rbwin;	/* Clip it by the read-ahead window */
+		n = run_sect(fp, fp->clust, fs->csize - csect, nrem);
+		if (n >= 2) {						/* Read ahead the following sectors */
+			if (disk_read(fs->pdrv, fp->rbuf, sect, n) != RES_OK) return FR_DISK_ERR;
+			fp->rbsect = sect; fp->n_rbsect = n; fp->rbofs = 0;
+		}
+		fp->rbwin = (fp->rbwin < 2) ? 2 : fp->rbwin * 2;	/* Grow the window while reading sequentially */
+		if (fp->rbwin > fp->sz_rbuf) fp->rbwin = fp->sz_rbuf;
+	}
+	if (fp->rbuf && sect - fp->rbsect < fp->n_rbsect) {	/* In the read-ahead buffer? */
+		memcpy(fp->buf, fp->rbuf + (fp->rbofs + (UINT)(sect - fp->rbsect)) * SS(fs), SS(fs));
+		return FR_OK;
+	}
+	return (disk_read(fs->pdrv, fp->buf, sect, 1) == RES_OK) ? FR_OK : FR_DISK_ERR;
+}
+
+
+#if FF_USE_FORWARD
 /*-----------------------------------------------------------------------*/
-/* FAT handling - Convert offset into cluster with link map table        */
+/* File read-ahead buffer - Load a bank for streaming f_forward()        */
 /*-----------------------------------------------------------------------*/
 
-static DWORD clmt_clust (	/* <2:Error, >=2:Cluster number */
+static FRESULT load_rbank (	/* FR_OK(0):succeeded, !=0:error */
 	FIL* fp,		/* Pointer to the file object */
-	FSIZE_t ofs		/* File offset to be converted to cluster# */
+	DWORD clst,		/* Cluster of the top sector */
+	LBA_t sect,		/* Top sector to be loaded */
+	FSIZE_t ofs		/* File offset of the top sector */
 )
 {
-	DWORD cl, ncl;
-	DWORD *tbl;
 	FATFS *fs = fp->obj.fs;
+	FSIZE_t nrem;
+	UINT n;
 
 
-	tbl = fp->cltbl + 1;	/* Top of CLMT */
-	cl = (DWORD)(ofs / SS(fs) / fs->csize);	/* Cluster order from top of the file */
-	for (;;) {
-		ncl = *tbl++;			/* Number of cluters in the fragment */
-		if (ncl == 0) return 0;	/* End of table? (error) */
-		if (cl < ncl) break;	/* In this fragment? */
-		cl -= ncl; tbl++;		/* Next fragment */
-	}
-	return cl + *tbl;	/* Return the cluster number */
+	nrem = (fp->obj.objsize - ofs + SS(fs) - 1) / SS(fs);	/* Sectors to the end of the file */
+	if (nrem > fp->sz_rbuf / 2) nrem = fp->sz_rbuf / 2;		/* Clip it by the bank size (half of the buffer) */
+	n = run_sect(fp, clst, fs->csize - (UINT)(ofs / SS(fs) & (fs->csize - 1)), nrem);
+	fp->n_rbsect = 0;
+	fp->rbofs = (fp->rbofs < fp->sz_rbuf / 2) ? fp->sz_rbuf / 2 : 0;	/* Switch to the other bank (the current one can be in transfer) */
+	if (disk_read(fs->pdrv, fp->rbuf + fp->rbofs * SS(fs), sect, n) != RES_OK) return FR_DISK_ERR;
+	fp->rbsect = sect; fp->n_rbsect = n;
+	return FR_OK;
 }
+#endif
 
-#endif	/* FF_USE_FASTSEEK */
+#endif	/* !FF_FS_TINY && FF_USE_RBUF */
 
 
 
 
 /*-----------------------------------------------------------------------*/
-/* Directory handling - Fill a cluster with zeros                        */
+/* Fill a block of sectors with zeros                                    */
 /*-----------------------------------------------------------------------*/
 
 #if !FF_FS_READONLY
-static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
+static FRESULT fill_zero (	/* Returns FR_OK or FR_DISK_ERR */
 	FATFS *fs,		/* Filesystem object */
-	DWORD clst		/* Directory table to clear */
+	LBA_t sect,		/* Top sector of the block */
+	LBA_t nsect		/* Number of sectors to fill (1..) */
 )
 {
-	LBA_t sect;
-	UINT n, szb;
+	LBA_t n;
+	UINT szb;
 	BYTE *ibuf;
+#if FF_USE_ZERO
+	LBA_t rng[2];
+#endif
 
 
 	if (sync_window(fs) != FR_OK) return FR_DISK_ERR;	/* Flush disk access window */
-	sect = clst2sect(fs, clst);		/* Top of the cluster */
-	fs->winsect = sect;				/* Set window to top of the cluster */
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+	fs->n_rasect = 0;				/* Discard the directory read-ahead buffer */
+#endif
+	fs->winsect = sect;				/* Set window to top of the block */
 	memset(fs->win, 0, sizeof fs->win);	/* Clear window buffer */
+#if FF_USE_ZERO
+	rng[0] = sect; rng[1] = sect + nsect - 1;
+	if (disk_ioctl(fs->pdrv, CTRL_ZERO, rng) == RES_OK) return FR_OK;	/* Let the device fill the block with 0 */
+#endif
 #if FF_USE_LFN == 3		/* Quick table clear by using multi-secter write */
 	/* Allocate a temporary buffer */
-	for (szb = ((DWORD)fs->csize * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : fs->csize * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
+	for (szb = (nsect * SS(fs) >= MAX_MALLOC) ? MAX_MALLOC : (UINT)nsect * SS(fs), ibuf = 0; szb > SS(fs) && (ibuf = ff_memalloc(szb)) == 0; szb /= 2) ;
 	if (szb > SS(fs)) {		/* Buffer allocated? */
 		memset(ibuf, 0, szb);
 		szb /= SS(fs);		/* Bytes -> Sectors */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
+		for (n = 0; n < nsect && disk_write(fs->pdrv, ibuf, sect + n, (nsect - n < szb) ? (UINT)(nsect - n) : szb) == RES_OK; n += szb) ;	/* Fill the block with 0 */
 		ff_memfree(ibuf);
 	} else
 #endif
 	{
 		ibuf = fs->win; szb = 1;	/* Use window buffer (many single-sector writes may take a time) */
-		for (n = 0; n < fs->csize && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the cluster with 0 */
+		for (n = 0; n < nsect && disk_write(fs->pdrv, ibuf, sect + n, szb) == RES_OK; n += szb) ;	/* Fill the block with 0 */
 	}
-	return (n == fs->csize) ? FR_OK : FR_DISK_ERR;
+	return (n >= nsect) ? FR_OK : FR_DISK_ERR;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Fill a cluster with zeros                        */
+/*-----------------------------------------------------------------------*/
+
+static FRESULT dir_clear (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS *fs,		/* Filesystem object */
+	DWORD clst		/* Directory table to clear */
+)
+{
+	return fill_zero(fs, clst2sect(fs, clst), fs->csize);	/* Window is set to top of the cluster */
 }
 #endif	/* !FF_FS_READONLY */
 
@@ -2331,6 +3141,33 @@ static void create_xdir (
 #define DIR_READ_FILE(dp) dir_read(dp, 0)
 #define DIR_READ_LABEL(dp) dir_read(dp, 1)
 
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+static FRESULT dir_prefetch (	/* FR_OK(0):succeeded, !=0:error */
+	DIR* dp		/* Pointer to the directory object */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	LBA_t sect = dp->sect;
+	UINT n;
+
+
+	if (sect == fs->winsect || sect - fs->rasect < fs->n_rasect) return FR_OK;	/* No need to read the sector? */
+
+	fs->n_rasect = 0;
+	if (dp->clust == 0) {	/* Static table (root-directory on the FAT volume) */
+		n = (UINT)(fs->dirbase + fs->n_rootdir / (SS(fs) / SZDIRE) - sect);
+	} else {				/* Dynamic table (sub-directory or root-directory on the FAT32/exFAT volume) */
+		n = fs->csize - (UINT)((sect - fs->database) & (fs->csize - 1));
+	}
+	if (n > FF_FS_DIRBURST) n = FF_FS_DIRBURST;
+	if (n < 2) return FR_OK;	/* Nothing to be read ahead */
+	if (take_sbuf(fs, SBUF_DIR) != FR_OK) return FR_DISK_ERR;
+	if (disk_read(fs->pdrv, fs->sbuf, sect, n) != RES_OK) return FR_DISK_ERR;
+	fs->rasect = sect; fs->n_rasect = n;	/* Sectors following the current one within the cluster */
+	return FR_OK;
+}
+#endif
+
 static FRESULT dir_read (
 	DIR* dp,		/* Pointer to the directory object */
 	int vol			/* Filtered by 0:file/directory or 1:volume label */
@@ -2344,6 +3181,12 @@ static FRESULT dir_read (
 #endif
 
 	while (dp->sect) {
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+		if (fs->raflag) {	/* Read the following sectors in a burst if in f_readdirs() */
+			res = dir_prefetch(dp);
+			if (res != FR_OK) break;
+		}
+#endif
 		res = move_window(fs, dp->sect);
 		if (res != FR_OK) break;
 		et = dp->dir[DIR_Name];	/* Test for the entry type */
@@ -2405,6 +3248,90 @@ static FRESULT dir_read (
 
 
 
+#if FF_FS_DIRCACHE
+/*-----------------------------------------------------------------------*/
+/* Directory handling - Lookup cache                                     */
+/*-----------------------------------------------------------------------*/
+/* A slot maps the name in a directory to the location of its entry block.
+/  The location is just a hint. dir_find() verifies the entry found there,
+/  so that a stale slot costs a directory scan but never a wrong result. */
+
+#define DC_DIR		0	/* Directory start cluster (0xFFFFFFFF:blank slot) */
+#define DC_HASH		1	/* Hash value of the name */
+#define DC_BLK		2	/* Offset of the top of entry block */
+#define DC_ENT		3	/* Offset of the last entry of the block */
+
+#if FF_USE_LFN
+#define DC_TOP(dp)	(((dp)->blk_ofs != 0xFFFFFFFF) ? (dp)->blk_ofs : (dp)->dptr)	/* Top of the entry block found */
+#else
+#define DC_TOP(dp)	((dp)->dptr)
+#endif
+
+static DWORD dc_hash (	/* Returns hash value of the name in the directory object */
+	DIR* dp				/* Directory object with the object name */
+)
+{
+	DWORD hv = 2166136261;	/* FNV-1a on the up-cased name */
+#if FF_USE_LFN
+	const WCHAR *lp = dp->obj.fs->lfnbuf;
+
+	while (*lp) hv = (hv ^ ff_wtoupper(*lp++)) * 16777619;
+#else
+	UINT i;
+
+	for (i = 0; i < 11; i++) hv = (hv ^ dp->fn[i]) * 16777619;
+#endif
+	return hv;
+}
+
+
+static DWORD* dc_slot (	/* Returns pointer to the slot for the name */
+	DIR* dp,			/* Directory object */
+	DWORD hv			/* Hash value of the name */
+)
+{
+	return dp->obj.fs->dcache[(hv ^ dp->obj.sclust) % FF_FS_DIRCACHE];
+}
+
+
+static void dc_put (
+	DIR* dp,			/* Directory object pointing the last entry of the block */
+	DWORD hv,			/* Hash value of the name */
+	DWORD blk			/* Offset of the top of entry block */
+)
+{
+	DWORD *sp = dc_slot(dp, hv);
+
+
+	sp[DC_DIR] = dp->obj.sclust;
+	sp[DC_HASH] = hv;
+	sp[DC_BLK] = blk;
+	sp[DC_ENT] = (FF_FS_EXFAT && dp->obj.fs->fs_type == FS_EXFAT) ? blk : dp->dptr;
+}
+
+
+#if !FF_FS_READONLY
+static void dc_forget (
+	DIR* dp,			/* Directory object */
+	DWORD blk			/* Offset of the top of entry block to be invalidated */
+)
+{
+	UINT i;
+	DWORD *sp;
+
+
+	for (i = 0; i < FF_FS_DIRCACHE; i++) {
+		sp = dp->obj.fs->dcache[i];
+		if (sp[DC_DIR] == dp->obj.sclust && sp[DC_BLK] == blk) sp[DC_DIR] = 0xFFFFFFFF;
+	}
+}
+#endif
+
+#endif	/* FF_FS_DIRCACHE */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
@@ -2416,71 +3343,107 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	FRESULT res;
 	FATFS *fs = dp->obj.fs;
 	BYTE et;
+	DWORD ofs = 0, lim = 0xFFFFFFFF;	/* Range of the entry blocks to be searched */
 #if FF_USE_LFN
 	BYTE attr, ord, sum;
 #endif
+#if FF_FS_DIRCACHE
+	DWORD hv = 0, *sp = 0;
 
-	res = dir_sdi(dp, 0);			/* Rewind directory object */
-	if (res != FR_OK) return res;
+	if (!FF_USE_LFN || !(dp->fn[NSFLAG] & NS_NOLFN)) {	/* Look up the cache except for the SFN collision test */
+		hv = dc_hash(dp);
+		sp = dc_slot(dp, hv);
+		if (sp[DC_DIR] == dp->obj.sclust && sp[DC_HASH] == hv) {	/* Hit? Search only the entry block there */
+			ofs = sp[DC_BLK]; lim = sp[DC_ENT];
+		}
+	}
+#endif
+
+	for (;;) {
+		res = dir_sdi(dp, ofs);			/* Rewind directory object (or go to the cached location) */
+		if (res != FR_OK) {
+#if FF_FS_DIRCACHE
+			if (lim != 0xFFFFFFFF && res == FR_INT_ERR) {	/* The cached location is out of the directory? */
+				sp[DC_DIR] = 0xFFFFFFFF;	/* Discard it and search the entire directory */
+				ofs = 0; lim = 0xFFFFFFFF;
+				continue;
+			}
+#endif
+			return res;
+		}
 #if FF_FS_EXFAT
-	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		BYTE nc;
-		UINT di, ni;
-		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
+		if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
+			BYTE nc;
+			UINT di, ni;
+			WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
 
-		while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
+			while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
+				if (dp->blk_ofs > lim) { res = FR_NO_FILE; break; }	/* Out of the range? */
 #if FF_MAX_LFN < 255
-			if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) continue;		/* Skip comparison if inaccessible object name */
+				if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) continue;		/* Skip comparison if inaccessible object name */
 #endif
-			if (ld_16(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
-			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
-				if ((di % SZDIRE) == 0) di += 2;
-				if (ff_wtoupper(ld_16(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+				if (ld_16(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
+				for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
+					if ((di % SZDIRE) == 0) di += 2;
+					if (ff_wtoupper(ld_16(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+				}
+				if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
 			}
-			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
-		}
-		return res;
-	}
+		} else
 #endif
-	/* On the FAT/FAT32 volume */
+		{
+			/* On the FAT/FAT32 volume */
 #if FF_USE_LFN
-	ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+			ord = sum = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
 #endif
-	do {
-		res = move_window(fs, dp->sect);
-		if (res != FR_OK) break;
-		et = dp->dir[DIR_Name];		/* Entry type */
-		if (et == 0) { res = FR_NO_FILE; break; }	/* Reached end of directory table */
+			do {
+				if (dp->dptr > lim) { res = FR_NO_FILE; break; }	/* Out of the range? */
+				res = move_window(fs, dp->sect);
+				if (res != FR_OK) break;
+				et = dp->dir[DIR_Name];		/* Entry type */
+				if (et == 0) { res = FR_NO_FILE; break; }	/* Reached end of directory table */
 #if FF_USE_LFN		/* LFN configuration */
-		dp->obj.attr = attr = dp->dir[DIR_Attr] & AM_MASK;
-		if (et == DDEM || ((attr & AM_VOL) && attr != AM_LFN)) {	/* An entry without valid data */
-			ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
-		} else {
-			if (attr == AM_LFN) {			/* Is it an LFN entry? */
-				if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
-					if (et & LLEF) {		/* Is it start of an entry set? */
-						et &= (BYTE)~LLEF;
-						ord = et;					/* Number of LFN entries */
-						dp->blk_ofs = dp->dptr;		/* Start offset of LFN */
-						sum = dp->dir[LDIR_Chksum];	/* Sum of the SFN */
+				dp->obj.attr = attr = dp->dir[DIR_Attr] & AM_MASK;
+				if (et == DDEM || ((attr & AM_VOL) && attr != AM_LFN)) {	/* An entry without valid data */
+					ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Reset LFN sequence */
+				} else {
+					if (attr == AM_LFN) {			/* Is it an LFN entry? */
+						if (!(dp->fn[NSFLAG] & NS_NOLFN)) {
+							if (et & LLEF) {		/* Is it start of an entry set? */
+								et &= (BYTE)~LLEF;
+								ord = et;					/* Number of LFN entries */
+								dp->blk_ofs = dp->dptr;		/* Start offset of LFN */
+								sum = dp->dir[LDIR_Chksum];	/* Sum of the SFN */
+							}
+							/* Check validity of the LFN entry and compare it with given name */
+							ord = (et == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
+						}
+					} else {					/* SFN entry */
+						if (ord == 0 && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
+						if (!(dp->fn[NSFLAG] & NS_LOSS) && !memcmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
+						ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Not matched, reset LFN sequence */
 					}
-					/* Check validity of the LFN entry and compare it with given name */
-					ord = (et == ord && sum == dp->dir[LDIR_Chksum] && cmp_lfn(fs->lfnbuf, dp->dir)) ? ord - 1 : 0xFF;
 				}
-			} else {					/* SFN entry */
-				if (ord == 0 && sum == sum_sfn(dp->dir)) break;	/* LFN matched? */
-				if (!(dp->fn[NSFLAG] & NS_LOSS) && !memcmp(dp->dir, dp->fn, 11)) break;	/* SFN matched? */
-				ord = 0xFF; dp->blk_ofs = 0xFFFFFFFF;	/* Not matched, reset LFN sequence */
+#else		/* Non LFN configuration */
+				dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
+				if (!(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
+#endif
+				res = dir_next(dp, 0);	/* Next entry */
+			} while (res == FR_OK);
+		}
+#if FF_FS_DIRCACHE
+		if (sp) {
+			if (res == FR_OK) {		/* Found? Remember the location */
+				dc_put(dp, hv, DC_TOP(dp));
+			} else if (lim != 0xFFFFFFFF && res == FR_NO_FILE) {	/* The cached location was stale? */
+				sp[DC_DIR] = 0xFFFFFFFF;	/* Discard it and search the entire directory */
+				ofs = 0; lim = 0xFFFFFFFF;
+				continue;
 			}
 		}
-#else		/* Non LFN configuration */
-		dp->obj.attr = dp->dir[DIR_Attr] & AM_MASK;
-		if (!(dp->dir[DIR_Attr] & AM_VOL) && !memcmp(dp->dir, dp->fn, 11)) break;	/* Is it a valid entry? */
 #endif
-		res = dir_next(dp, 0);	/* Next entry */
-	} while (res == FR_OK);
-
-	return res;
+		return res;
+	}
 }
 
 
@@ -2539,6 +3502,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 		}
 
 		create_xdir(fs->dirbuf, fs->lfnbuf);	/* Create on-memory directory block to be written later */
+#if FF_FS_DIRCACHE
+		dc_put(dp, dc_hash(dp), dp->blk_ofs);	/* Remember the location of the new entry block */
+#endif
 		return FR_OK;
 	}
 #endif
@@ -2559,6 +3525,7 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 	/* Create an SFN with/without LFNs. */
 	n_ent = (sn[NSFLAG] & NS_LFN) ? (len + 12) / 13 + 1 : 1;	/* Number of entries to allocate */
 	res = dir_alloc(dp, n_ent);		/* Allocate entries */
+	dp->blk_ofs = (n_ent > 1) ? dp->dptr - (n_ent - 1) * SZDIRE : 0xFFFFFFFF;	/* Top of the entry block */
 	if (res == FR_OK && --n_ent) {	/* Set LFN entry if needed */
 		res = dir_sdi(dp, dp->dptr - n_ent * SZDIRE);
 		if (res == FR_OK) {
@@ -2589,6 +3556,9 @@ static FRESULT dir_register (	/* FR_OK:succeeded, FR_DENIED:no free entry or too
 			dp->dir[DIR_NTres] = dp->fn[NSFLAG] & (NS_BODY | NS_EXT);	/* Put low-case flags */
 #endif
 			fs->wflag = 1;
+#if FF_FS_DIRCACHE
+			dc_put(dp, dc_hash(dp), DC_TOP(dp));	/* Remember the location of the new entry block */
+#endif
 		}
 	}
 
@@ -2613,6 +3583,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 #if FF_USE_LFN		/* LFN configuration */
 	DWORD last = dp->dptr;
 
+#if FF_FS_DIRCACHE
+	dc_forget(dp, DC_TOP(dp));	/* The entry block will be no longer valid */
+#endif
 	res = (dp->blk_ofs == 0xFFFFFFFF) ? FR_OK : dir_sdi(dp, dp->blk_ofs);	/* Goto top of the entry block if LFN is exist */
 	if (res == FR_OK) {
 		do {
@@ -2631,6 +3604,9 @@ static FRESULT dir_remove (	/* FR_OK:Succeeded, FR_DISK_ERR:A disk error */
 	}
 #else			/* Non LFN configuration */
 
+#if FF_FS_DIRCACHE
+	dc_forget(dp, DC_TOP(dp));	/* The entry will be no longer valid */
+#endif
 	res = move_window(fs, dp->sect);
 	if (res == FR_OK) {
 		dp->dir[DIR_Name] = DDEM;	/* Mark the entry 'deleted'.*/
@@ -3469,6 +4445,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	DSTATUS stat;
 	LBA_t bsect;
 	UINT fmt;
+#if !FF_FS_READONLY && FF_FS_AUALIGN
+	DWORD au, ofs;
+#endif
 
 
 	/* Get logical drive number */
@@ -3498,7 +4477,22 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 	/* The filesystem object is not valid. */
 	/* Following code attempts to mount the volume. (find an FAT volume, analyze the BPB and initialize the filesystem object) */
 
-	fs->fs_type = 0;					/* Invalidate the filesystem object */
+	fs->fs_type = 0;					/* Invalidate the filesystem object (what is held for the previous media is dropped, it may have been changed) */
+#if !FF_FS_READONLY && FF_FS_LAZYFAT
+	fs->n_fat2run = 0;					/* Discard the pending 2nd FAT runs of the previous media */
+#endif
+#if FF_FS_EXFAT && !FF_FS_READONLY && FF_FS_BMCACHE
+	fs->n_bmsect = 0; fs->bmdhi = 0;	/* Discard the allocation bitmap cache of the previous media */
+#endif
+#if FF_FS_DIRCACHE
+	memset(fs->dcache, 0xFF, sizeof fs->dcache);	/* Clear the directory lookup cache */
+#endif
+#if FF_FS_MINIMIZE <= 1 && FF_FS_DIRBURST
+	fs->raflag = 0; fs->n_rasect = 0;	/* Clear the directory read-ahead buffer */
+#endif
+#if FF_SBUF_SECT
+	fs->sbuf_use = 0;					/* Nobody uses the scratch buffer */
+#endif
 	stat = disk_initialize(fs->pdrv);	/* Initialize the volume hosting physical drive */
 	if (stat & STA_NOINIT) { 			/* Check if the initialization succeeded */
 		return FR_NOT_READY;			/* Failed to initialize due to no medium or hard error */
@@ -3661,6 +4655,17 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 #endif	/* !FF_FS_READONLY */
 	}
 
+#if !FF_FS_READONLY && FF_FS_AUALIGN
+	fs->au_clst = 0;	/* Get the allocation unit of the device to align large allocations to */
+	if (disk_ioctl(fs->pdrv, GET_BLOCK_SIZE, &au) == RES_OK && au > fs->csize && au % fs->csize == 0) {
+		ofs = (DWORD)(fs->database % au);	/* Offset of the data area from an AU boundary */
+		if (ofs % fs->csize == 0) {			/* Are the clusters aligned to the AU boundaries? */
+			fs->au_clst = au / fs->csize;
+			fs->au_top = 2 + (au - ofs) % au / fs->csize;
+		}
+	}
+#endif
+
 	fs->fs_type = (BYTE)fmt;/* FAT sub-type (the filesystem object gets valid) */
 	fs->id = ++Fsid;		/* Volume mount ID */
 
@@ -3754,6 +4759,9 @@ FRESULT f_mount (
 
 	cfs = FatFs[vol];			/* Pointer to the filesystem object of the volume */
 	if (cfs) {					/* Unregister current filesystem object */
+#if !FF_FS_READONLY
+		if (cfs->fs_type) sync_fs(cfs);	/* Write back the held bitmap sectors and 2nd FAT runs (error is ignored at unmount) */
+#endif
 		FatFs[vol] = 0;
 #if FF_FS_LOCK					/* Clear file lock semaphores correspond to this volume */
 		clear_share(cfs);
@@ -3805,12 +4813,18 @@ FRESULT f_open (
 	FRESULT res;
 	DIR dj;
 	FATFS *fs;
+#if FF_USE_EXPAND
+	BYTE ctg;
+#endif
 	DEF_NAMEBUFF
 
 
 	if (!fp) return FR_INVALID_OBJECT;	/* Reject null pointer */
 
 	/* Get logical drive number and mount the volume if needed */
+#if FF_USE_EXPAND
+	ctg = mode & FA_CONTIGUOUS;		/* Contiguous file mode */
+#endif
 	mode &= FF_FS_READONLY ? FA_READ : FA_READ | FA_WRITE | FA_CREATE_ALWAYS | FA_CREATE_NEW | FA_OPEN_ALWAYS | FA_OPEN_APPEND;
 	res = mount_volume(&path, &fs, mode);
 
@@ -3936,24 +4950,54 @@ FRESULT f_open (
 			}
 #if FF_USE_FASTSEEK
 			fp->cltbl = 0;		/* Disable fast seek mode */
+#endif
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+			fp->wbuf = 0; fp->n_wbsect = 0;	/* No write-behind buffer */
+#endif
+#if !FF_FS_TINY && FF_USE_RBUF
+			fp->rbuf = 0; fp->n_rbsect = 0; fp->rbwin = 0; fp->rbofs = 0;	/* No read-ahead buffer */
 #endif
 			fp->obj.id = fs->id;	/* Set current volume mount ID */
 			fp->flag = mode;	/* Set file access mode */
 			fp->err = 0;		/* Clear error flag */
 			fp->sect = 0;		/* Invalidate current data sector */
 			fp->fptr = 0;		/* Set file pointer top of the file */
+#if !FF_FS_READONLY && FF_FS_LAZYSYNC
+			fp->dir_size = fp->obj.objsize;		/* Allocation information recorded in the directory entry */
+			fp->dir_sclust = fp->obj.sclust;
+#if FF_FS_LAZYSYNC_SEC
+			fp->dir_tick = FF_FS_LAZYSYNC_TICK();
+#endif
+			fp->n_sync = 0;
+#endif
+#if FF_USE_EXPAND
+			fp->n_ctg = 0;
+			if (ctg) {			/* Check if the file is contiguous if FA_CONTIGUOUS is specified */
+				res = get_extent(fp);
+#if FF_FS_LOCK
+				if (res != FR_OK) dec_share(fp->obj.lockid);
+#endif
+			}
+#endif
 #if !FF_FS_READONLY
 #if !FF_FS_TINY
 			memset(fp->buf, 0, sizeof fp->buf);	/* Clear sector buffer */
 #endif
-			if ((mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
+			if (res == FR_OK && (mode & FA_SEEKEND) && fp->obj.objsize > 0) {	/* Seek to end of file if FA_OPEN_APPEND is specified */
 				DWORD bcs, clst;
 				FSIZE_t ofs;
 
 				fp->fptr = fp->obj.objsize;			/* Offset to seek */
 				bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size in byte */
 				clst = fp->obj.sclust;				/* Follow the cluster chain */
-				for (ofs = fp->obj.objsize; res == FR_OK && ofs > bcs; ofs -= bcs) {
+				ofs = fp->obj.objsize;
+#if FF_USE_EXPAND
+				if (fp->n_ctg) {					/* Contiguous file? */
+					clst += (DWORD)((ofs - 1) / bcs);	/* Last cluster of the file */
+					ofs -= (FSIZE_t)((ofs - 1) / bcs) * bcs;
+				}
+#endif
+				for ( ; res == FR_OK && ofs > bcs; ofs -= bcs) {
 					clst = get_fat(&fp->obj, clst);
 					if (clst <= 1) res = FR_INT_ERR;
 					if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
@@ -4012,6 +5056,9 @@ FRESULT f_read (
 	res = validate(&fp->obj, &fs);				/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED); /* Check access mode */
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+	if (flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Make the written sectors visible to disk_read */
+#endif
 	remain = fp->obj.objsize - fp->fptr;
 	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
 
@@ -4024,6 +5071,11 @@ FRESULT f_read (
 				if (fp->fptr == 0) {			/* On the top of the file? */
 					clst = fp->obj.sclust;		/* Follow cluster chain from the origin */
 				} else {						/* Middle or end of the file */
+#if FF_USE_EXPAND
+					if ((DWORD)(fp->fptr / SS(fs) / fs->csize) < fp->n_ctg) {
+						clst = fp->clust + 1;		/* Next cluster in the contiguous extent */
+					} else
+#endif
 #if FF_USE_FASTSEEK
 					if (fp->cltbl) {
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
@@ -4042,10 +5094,17 @@ FRESULT f_read (
 			sect += csect;
 			cc = btr / SS(fs);					/* When remaining bytes >= sector size, */
 			if (cc > 0) {						/* Read maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				cc = run_sect(fp, fp->clust, fs->csize - csect, cc);	/* Clip at the end of contiguous clusters */
+#if !FF_FS_TINY && FF_USE_RBUF
+				if (fp->rbuf && sect - fp->rbsect < fp->n_rbsect) {	/* Top sector is in the read-ahead buffer? */
+					if (cc > fp->rbsect + fp->n_rbsect - sect) cc = (UINT)(fp->rbsect + fp->n_rbsect - sect);
+					memcpy(rbuff, fp->rbuf + (fp->rbofs + (UINT)(sect - fp->rbsect)) * SS(fs), cc * SS(fs));	/* Take them from the buffer */
+				} else
+#endif
+				{
+					if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 				}
-				if (disk_read(fs->pdrv, rbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
+				fp->clust += (DWORD)((csect + cc - 1) / fs->csize);	/* Move to the last cluster read */
 #if !FF_FS_READONLY && FF_FS_MINIMIZE <= 2		/* Replace one of the read sectors with cached data if it contains a dirty sector */
 #if FF_FS_TINY
 				if (fs->wflag && fs->winsect - sect < cc) {
@@ -4068,7 +5127,11 @@ FRESULT f_read (
 					fp->flag &= (BYTE)~FA_DIRTY;
 				}
 #endif
+#if FF_USE_RBUF
+				if (load_rbuf(fp, sect, csect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache via the read-ahead buffer */
+#else
 				if (disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+#endif
 			}
 #endif
 			fp->sect = sect;
@@ -4089,6 +5152,87 @@ FRESULT f_read (
 
 
 
+#if !FF_FS_TINY && FF_USE_RBUF
+/*-----------------------------------------------------------------------*/
+/* API: Attach a Read-ahead Buffer to the File                           */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_setrbuf (
+	FIL* fp,		/* Open file to attach the buffer */
+	void* buf,		/* Pointer to the buffer (null:detach the buffer) */
+	UINT sz			/* Size of the buffer [byte] (two sectors at least) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (buf && sz / SS(fs) < 2) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+
+	fp->rbuf = (BYTE*)buf;
+	fp->sz_rbuf = buf ? sz / SS(fs) : 0;
+	fp->n_rbsect = 0; fp->rbwin = 0; fp->rbofs = 0;
+
+	LEAVE_FF(fs, FR_OK);
+}
+#endif
+
+
+
+
+#if !FF_FS_TINY && FF_USE_VIEW
+/*-----------------------------------------------------------------------*/
+/* API: Get a View of the File Data                                      */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_getview (
+	FIL* fp,			/* Open file to be read */
+	const void** view,	/* Pointer to the variable to return the pointer to the data */
+	UINT btr,			/* Maximum number of bytes to view */
+	UINT* br			/* Pointer to the variable to return number of bytes viewed (0:end of file) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	FSIZE_t ofs;
+	const BYTE *dp;
+	UINT n, nd;
+	BYTE c;
+
+
+	*view = 0; *br = 0;
+	res = f_read(fp, &c, btr ? 1 : 0, &n);	/* Get the first byte in the regular way (this loads the sector cache) */
+	if (res != FR_OK || n == 0) return res;
+	fs = fp->obj.fs;
+	ofs = fp->fptr - 1;				/* File offset of the view */
+	dp = fp->buf + ofs % SS(fs);	/* The first byte in the sector cache */
+	n = SS(fs) - (UINT)(ofs % SS(fs));	/* Bytes to the end of the sector */
+#if FF_USE_RBUF
+	if (fp->rbuf && fp->sect - fp->rbsect < fp->n_rbsect) {	/* Is the sector in the read-ahead buffer? */
+		dp = fp->rbuf + (fp->rbofs + (UINT)(fp->sect - fp->rbsect)) * SS(fs) + ofs % SS(fs);	/* View it in the read-ahead buffer */
+		n += (UINT)(fp->rbsect + fp->n_rbsect - fp->sect - 1) * SS(fs);	/* with the following sectors */
+	}
+#endif
+	if (n > btr) n = btr;
+	if (n > fp->obj.objsize - ofs) n = (UINT)(fp->obj.objsize - ofs);
+
+	fp->fptr = ofs + n;				/* Move the file pointer past the view */
+	nd = (UINT)((fp->fptr - 1) / SS(fs) - ofs / SS(fs));	/* Number of sectors moved on */
+	if (nd > 0) {					/* Track the sector cache and current cluster to the file pointer */
+		fp->clust += (DWORD)((fp->fptr - 1) / SS(fs) / fs->csize - ofs / SS(fs) / fs->csize);	/* (the sectors in rbuf[] are contiguous) */
+		fp->sect += nd;
+		memcpy(fp->buf, dp + n - 1 - (fp->fptr - 1) % SS(fs), SS(fs));
+	}
+	*view = dp; *br = n;
+	return FR_OK;
+}
+#endif
+
+
+
+
 #if !FF_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* API: Write File                                                       */
@@ -4103,7 +5247,7 @@ FRESULT f_write (
 {
 	FRESULT res;
 	FATFS *fs;
-	DWORD clst;
+	DWORD clst, nrun = 0;
 	LBA_t sect;
 	UINT wcnt, cc, csect;
 	const BYTE *wbuff = (const BYTE*)buff;
@@ -4113,6 +5257,9 @@ FRESULT f_write (
 	res = validate(&fp->obj, &fs);			/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);	/* Check validity */
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if !FF_FS_TINY && FF_USE_RBUF
+	fp->n_rbsect = 0;	/* Discard the read-ahead buffer that can be overwritten */
+#endif
 
 	/* Check fptr wrap-around (file size cannot reach 4 GiB at FAT volume) */
 	if ((!FF_FS_EXFAT || fs->fs_type != FS_EXFAT) && (DWORD)(fp->fptr + btw) < (DWORD)fp->fptr) {
@@ -4126,16 +5273,25 @@ FRESULT f_write (
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->obj.sclust;	/* Follow from the origin */
 					if (clst == 0) {		/* If no cluster is allocated, */
-						clst = create_chain(&fp->obj, 0);	/* create a new cluster chain */
+						nrun = (DWORD)((btw - 1) / SS(fs) / fs->csize + 1);	/* Clusters to be written */
+						clst = create_chain_run(&fp->obj, 0, &nrun);	/* create a new cluster chain at a time */
 					}
+				} else if (nrun > 1) {		/* In the run allocated by this function? */
+					clst = fp->clust + 1; nrun--;
 				} else {					/* On the middle or end of the file */
+#if FF_USE_EXPAND
+					if ((DWORD)(fp->fptr / SS(fs) / fs->csize) < fp->n_ctg) {
+						clst = fp->clust + 1;	/* Next cluster in the contiguous extent */
+					} else
+#endif
 #if FF_USE_FASTSEEK
 					if (fp->cltbl) {
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					} else
 #endif
 					{
-						clst = create_chain(&fp->obj, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+						nrun = (DWORD)((btw - 1) / SS(fs) / fs->csize + 1);	/* Clusters to be written */
+						clst = create_chain_run(&fp->obj, fp->clust, &nrun);	/* Follow or stretch cluster chain on the FAT */
 					}
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
@@ -4148,7 +5304,11 @@ FRESULT f_write (
 			if (fs->winsect == fp->sect && sync_window(fs) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Write-back sector cache */
 #else
 			if (fp->flag & FA_DIRTY) {		/* Write-back sector cache */
+#if FF_USE_WBUF
+				if (put_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Collect it in the write-behind buffer */
+#else
 				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+#endif
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
 #endif
@@ -4157,9 +5317,19 @@ FRESULT f_write (
 			sect += csect;
 			cc = btw / SS(fs);				/* When remaining bytes >= sector size, */
 			if (cc > 0) {					/* Write maximum contiguous sectors directly */
-				if (csect + cc > fs->csize) {	/* Clip at cluster boundary */
-					cc = fs->csize - csect;
+				if (csect + cc > fs->csize) {	/* Clip at cluster boundary, or at the end of the contiguous clusters known */
+					clst = (nrun > 1) ? nrun - 1 : 0;	/* Contiguous clusters following the current one */
+#if FF_USE_EXPAND
+					if ((DWORD)(fp->fptr / SS(fs) / fs->csize) < fp->n_ctg) clst = fp->n_ctg - 1 - (DWORD)(fp->fptr / SS(fs) / fs->csize);
+#endif
+					if (cc > fs->csize - csect + clst * fs->csize) cc = fs->csize - csect + clst * fs->csize;
+					clst = (csect + cc - 1) / fs->csize;	/* Number of clusters crossed */
+					fp->clust += clst;					/* Move to the last cluster written */
+					nrun = (nrun > clst) ? nrun - clst : 0;
 				}
+#if !FF_FS_TINY && FF_USE_WBUF
+				if (flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Keep the write order */
+#endif
 				if (disk_write(fs->pdrv, wbuff, sect, cc) != RES_OK) ABORT(fs, FR_DISK_ERR);
 #if FF_FS_MINIMIZE <= 2
 #if FF_FS_TINY
@@ -4221,16 +5391,34 @@ FRESULT f_sync (
 {
 	FRESULT res;
 	FATFS *fs;
+#if FF_FS_LAZYSYNC
+	int defer;
+#endif
 
 
 	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
 	if (res == FR_OK) {
 		if (fp->flag & FA_MODIFIED) {	/* Is there any change to the file? */
+#if FF_FS_LAZYSYNC
+			defer = defer_dir(fp);	/* Defer the directory entry update? (puts the size checkpoint into the sector buffer) */
+#endif
 #if !FF_FS_TINY
 			if (fp->flag & FA_DIRTY) {	/* Write-back cached data if needed */
+#if FF_USE_WBUF
+				if (put_wbuf(fp) != FR_OK) LEAVE_FF(fs, FR_DISK_ERR);
+#else
 				if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) LEAVE_FF(fs, FR_DISK_ERR);
+#endif
 				fp->flag &= (BYTE)~FA_DIRTY;
 			}
+#if FF_USE_WBUF
+			if (flush_wbuf(fp) != FR_OK) LEAVE_FF(fs, FR_DISK_ERR);	/* Write-back the write-behind buffer */
+#endif
+#endif
+#if FF_FS_LAZYSYNC
+			if (defer) {
+				LEAVE_FF(fs, sync_fs(fs));	/* Flush the FAT and bitmap, the size is recorded later */
+			}
 #endif
 			/* Update the directory entry */
 #if FF_FS_EXFAT
@@ -4281,12 +5469,52 @@ FRESULT f_sync (
 					fp->flag &= (BYTE)~FA_MODIFIED;
 				}
 			}
+#if FF_FS_LAZYSYNC
+			if (!(fp->flag & FA_MODIFIED)) {	/* Record the state of the directory entry */
+				fp->dir_size = fp->obj.objsize;
+				fp->dir_sclust = fp->obj.sclust;
+#if FF_FS_LAZYSYNC_SEC
+				fp->dir_tick = FF_FS_LAZYSYNC_TICK();
+#endif
+				fp->n_sync = 0;
+			}
+#endif
 		}
 	}
 
 	LEAVE_FF(fs, res);
 }
 
+
+
+
+#if !FF_FS_TINY && FF_USE_WBUF
+/*-----------------------------------------------------------------------*/
+/* API: Attach a Write-behind Buffer to the File                         */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_setwbuf (
+	FIL* fp,		/* Open file to attach the buffer */
+	void* buf,		/* Pointer to the buffer (null:detach the buffer) */
+	UINT sz			/* Size of the buffer [byte] (two sectors at least) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);	/* Check validity of the file object */
+	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
+	if (buf && sz / SS(fs) < 2) LEAVE_FF(fs, FR_INVALID_PARAMETER);
+
+	if (flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Flush the current buffer */
+	fp->wbuf = (BYTE*)buf;
+	fp->sz_wbuf = buf ? sz / SS(fs) : 0;
+
+	LEAVE_FF(fs, FR_OK);
+}
+#endif
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -4304,6 +5532,9 @@ FRESULT f_close (
 	FATFS *fs;
 
 #if !FF_FS_READONLY
+#if FF_FS_LAZYSYNC
+	fp->n_sync = FF_FS_LAZYSYNC;		/* Update the directory entry without deferring */
+#endif
 	res = f_sync(fp);					/* Flush cached data */
 	if (res == FR_OK)
 #endif
@@ -4562,6 +5793,9 @@ FRESULT f_lseek (
 	DWORD clst, bcs;
 	LBA_t nsect;
 	FSIZE_t ifptr;
+#if !FF_FS_READONLY
+	DWORD nrun = 0;
+#endif
 
 
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
@@ -4572,6 +5806,12 @@ FRESULT f_lseek (
 	}
 #endif
 	if (res != FR_OK) LEAVE_FF(fs, res);
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+	if (ofs != fp->fptr && flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Flush the write-behind buffer on seeking away */
+#endif
+#if !FF_FS_TINY && FF_USE_RBUF
+	if (ofs != fp->fptr) fp->rbwin = 0;	/* Restart the sequential access detection */
+#endif
 
 #if FF_USE_FASTSEEK
 	if (fp->cltbl) {	/* Fast seek */
@@ -4650,7 +5890,8 @@ FRESULT f_lseek (
 				clst = fp->obj.sclust;					/* start from the first cluster */
 #if !FF_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
-					clst = create_chain(&fp->obj, 0);
+					nrun = (DWORD)((ofs - 1) / bcs + 1);	/* Clusters to the destination */
+					clst = create_chain_run(&fp->obj, 0, &nrun);
 					if (clst == 1) ABORT(fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
 					fp->obj.sclust = clst;
@@ -4659,17 +5900,31 @@ FRESULT f_lseek (
 				fp->clust = clst;
 			}
 			if (clst != 0) {
+#if FF_USE_EXPAND
+				if (ofs > bcs && fp->fptr / bcs < fp->n_ctg) {	/* Jump in the contiguous extent */
+					DWORD ncl = (DWORD)((ofs - 1) / bcs);
+
+					if (ncl > fp->n_ctg - 1 - (DWORD)(fp->fptr / bcs)) ncl = fp->n_ctg - 1 - (DWORD)(fp->fptr / bcs);
+					clst += ncl; fp->clust = clst;
+					ofs -= (FSIZE_t)ncl * bcs; fp->fptr += (FSIZE_t)ncl * bcs;
+				}
+#endif
 				while (ofs > bcs) {						/* Cluster following loop */
 					ofs -= bcs; fp->fptr += bcs;
 #if !FF_FS_READONLY
 					if (fp->flag & FA_WRITE) {			/* Check if in write mode or not */
-						if (FF_FS_EXFAT && fp->fptr > fp->obj.objsize) {	/* No FAT chain object needs correct objsize to generate FAT value */
-							fp->obj.objsize = fp->fptr;
-							fp->flag |= FA_MODIFIED;
-						}
-						clst = create_chain(&fp->obj, clst);	/* Follow chain with forceed stretch */
-						if (clst == 0) {				/* Clip file size in case of disk full */
-							ofs = 0; break;
+						if (nrun > 1) {					/* In the run allocated at a time? */
+							clst++; nrun--;
+						} else {
+							if (FF_FS_EXFAT && fp->fptr > fp->obj.objsize) {	/* No FAT chain object needs correct objsize to generate FAT value */
+								fp->obj.objsize = fp->fptr;
+								fp->flag |= FA_MODIFIED;
+							}
+							nrun = (DWORD)((ofs - 1) / bcs + 1);	/* Clusters to the destination */
+							clst = create_chain_run(&fp->obj, clst, &nrun);	/* Follow chain with forceed stretch */
+							if (clst == 0) {				/* Clip file size in case of disk full */
+								ofs = 0; break;
+							}
 						}
 					} else
 #endif
@@ -4842,6 +6097,59 @@ FRESULT f_readdir (
 
 
 
+#if FF_FS_DIRBURST
+/*-----------------------------------------------------------------------*/
+/* Read Directory Entries into an Array                                  */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_readdirs (
+	DIR* dp,			/* Pointer to the open directory object */
+	FFDIRENT* ents,		/* Pointer to the array to store the items */
+	UINT n,				/* Number of items in the array */
+	UINT* nr			/* Pointer to the variable to return number of items read (0:end of directory) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	FILINFO fno;
+	FFDIRENT *ent = ents;
+	DEF_NAMEBUFF
+
+
+	*nr = 0;
+	res = validate(&dp->obj, &fs);	/* Check validity of the directory object */
+	if (res == FR_OK) {
+		INIT_NAMEBUFF(fs);
+		fs->raflag = 1;				/* Read the directory sectors in bursts */
+		while (res == FR_OK && *nr < n) {
+			res = DIR_READ_FILE(dp);	/* Read an item */
+			if (res != FR_OK) break;
+			get_fileinfo(dp, &fno);		/* Get the object information */
+			ent->fsize = fno.fsize;
+			ent->fattrib = fno.fattrib;
+			memcpy(ent->fname, fno.fname, sizeof ent->fname);
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				ent->sclust = ld_32(fs->dirbuf + XDIR_FstClus);
+			} else
+#endif
+			{
+				ent->sclust = ld_clust(fs, dp->dir);
+			}
+			ent++; (*nr)++;
+			res = dir_next(dp, 0);		/* Increment index for next */
+		}
+		if (res == FR_NO_FILE) res = FR_OK;	/* Ignore end of directory */
+		fs->raflag = 0;
+		FREE_NAMEBUFF();
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
 #if FF_USE_FIND
 /*-----------------------------------------------------------------------*/
 /* API: Find Next File                                                   */
@@ -4976,22 +6284,23 @@ FRESULT f_getfree (
 			} else {
 #if FF_FS_EXFAT
 				if (fs->fs_type == FS_EXFAT) {	/* exFAT: Scan allocation bitmap */
-					BYTE bm;
-					UINT b;
+					BYTE bm, *bp = 0;
+					UINT b, nb = 0;
+					DWORD ofs = 0;
 
 					clst = fs->n_fatent - 2;	/* Number of clusters */
-					sect = fs->bitbase;			/* Bitmap sector */
-					i = 0;						/* Offset in the sector */
 					do {	/* Counts numbuer of clear bits (free clusters) in the bitmap */
-						if (i == 0) {	/* New sector? */
-							res = move_window(fs, sect++);
-							if (res != FR_OK) break;
+						if (nb == 0) {	/* End of the cached bytes? */
+							bp = bitmap_ptr(fs, ofs, &nb);
+							if (!bp) {
+								res = FR_DISK_ERR; break;
+							}
 						}
-						for (b = 8, bm = ~fs->win[i]; b && clst; b--, clst--) {	/* Count clear bits in a byte */
+						for (b = 8, bm = ~*bp; b && clst; b--, clst--) {	/* Count clear bits in a byte */
 							nfree += bm & 1;
 							bm >>= 1;
 						}
-						i = (i + 1) % SS(fs);	/* Next byte */
+						bp++; nb--; ofs++;	/* Next byte */
 					} while (clst);
 				} else
 #endif
@@ -5048,6 +6357,9 @@ FRESULT f_truncate (
 	if (!(fp->flag & FA_WRITE)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
 
 	if (fp->fptr < fp->obj.objsize) {	/* Process when fptr is not on the eof */
+#if !FF_FS_TINY && FF_USE_WBUF
+		if (flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Flush the write-behind buffer before the clusters are freed */
+#endif
 		if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
 			res = remove_chain(&fp->obj, fp->obj.sclust, 0);
 			fp->obj.sclust = 0;
@@ -5062,6 +6374,10 @@ FRESULT f_truncate (
 		}
 		fp->obj.objsize = fp->fptr;	/* Set file size to current read/write point */
 		fp->flag |= FA_MODIFIED;
+#if FF_USE_EXPAND
+		ncl = (DWORD)((fp->obj.objsize + (FSIZE_t)fs->csize * SS(fs) - 1) / ((FSIZE_t)fs->csize * SS(fs)));	/* Clusters left */
+		if (fp->n_ctg > ncl) fp->n_ctg = ncl;
+#endif
 #if !FF_FS_TINY
 		if (res == FR_OK && (fp->flag & FA_DIRTY)) {
 			if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) {
@@ -5494,6 +6810,121 @@ FRESULT f_utime (
 
 
 
+
+#if !FF_FS_READONLY && FF_FS_LAZYSYNC
+/*-----------------------------------------------------------------------*/
+/* API: Reconcile File Size with the Cluster Chain                       */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_recover (
+	const TCHAR* path	/* Pointer to the file path */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DIR dj;
+	FFOBJID obj;
+	DWORD clst, n, bcs;
+	FSIZE_t ofs, end, sz;
+	LBA_t sect;
+	UINT i;
+	BYTE *chk;
+	DEF_NAMEBUFF
+
+
+	/* Get logical drive and mount the volume if needed */
+	res = mount_volume(&path, &fs, FA_WRITE);
+	if (res == FR_OK) {
+		dj.obj.fs = fs;
+		INIT_NAMEBUFF(fs);
+		res = follow_path(&dj, path);	/* Follow the file path */
+		if (res == FR_OK) {
+			if (dj.fn[NSFLAG] & (NS_DOT | NS_NONAME)) {
+				res = FR_INVALID_NAME;	/* It must be a real object */
+			} else if (dj.obj.attr & AM_DIR) {
+				res = FR_NO_FILE;		/* It must be a file */
+#if FF_FS_LOCK
+			} else {
+				res = chk_share(&dj, 2);	/* The file must not be open */
+#endif
+			}
+		}
+		if (res == FR_OK) {
+			obj.fs = fs;
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {
+				init_alloc_info(&obj, 0);
+			} else
+#endif
+			{
+				obj.sclust = ld_clust(fs, dj.dir);
+				obj.objsize = ld_32(dj.dir + DIR_FileSize);
+				obj.stat = 0;
+			}
+			bcs = (DWORD)fs->csize * SS(fs);	/* Cluster size */
+			end = 0;	/* Size in the last size checkpoint */
+			for (clst = obj.sclust, n = 0, ofs = 0; res == FR_OK && clst >= 2 && clst < fs->n_fatent; n++, ofs += bcs) {
+				if (obj.objsize % bcs != 0 && obj.objsize - ofs < bcs) {	/* The cluster holding the recorded end of the file? */
+					sect = clst2sect(fs, clst);
+					for (i = (UINT)((obj.objsize - ofs) / SS(fs)); res == FR_OK && i < fs->csize; i++) {	/* Look for the checkpoint in the sectors from it */
+						res = move_window(fs, sect + i);
+						if (res != FR_OK) break;
+						chk = fs->win + SS(fs) - SZ_SZCHK;
+						sz = (FSIZE_t)ld_32(chk + SZCHK_SizeH) << 16 << 16 | ld_32(chk + SZCHK_SizeL);
+						if (ld_32(chk + SZCHK_Sig) == SZCHK_SIG
+							&& ld_32(chk + SZCHK_DirSize) == (DWORD)obj.objsize	/* Written since the directory entry was updated */
+							&& ld_32(chk + SZCHK_FstClus) == obj.sclust
+							&& sz > obj.objsize && (sz - ofs - 1) / SS(fs) == i	/* Placed in the sector holding the end of the file */
+							&& sz % SS(fs) != 0 && sz % SS(fs) <= SS(fs) - SZ_SZCHK) {
+							end = sz;
+						}
+					}
+				}
+#if FF_FS_EXFAT
+				if (fs->fs_type == FS_EXFAT && obj.stat == 2) {	/* No FAT chain object is as long as the recorded size */
+					clst = ((FSIZE_t)(n + 1) * bcs < obj.objsize) ? clst + 1 : 0;
+				} else
+#endif
+				{
+					clst = get_fat(&obj, clst);	/* Follow the cluster chain */
+					if (clst == 1 || n >= fs->n_fatent) res = FR_INT_ERR;
+					if (clst == 0xFFFFFFFF) res = FR_DISK_ERR;
+				}
+			}
+			if (res == FR_OK) {
+				if (end > obj.objsize) obj.objsize = end;	/* Extend the size to the last checkpoint */
+				if (obj.objsize > ofs) obj.objsize = ofs;	/* Clip the size at the end of the chain */
+#if FF_FS_EXFAT
+				if (fs->fs_type == FS_EXFAT) {
+					if (obj.objsize != ld_64(fs->dirbuf + XDIR_FileSize)) {
+						st_64(fs->dirbuf + XDIR_FileSize, obj.objsize);
+						st_64(fs->dirbuf + XDIR_ValidFileSize, obj.objsize);
+						res = store_xdir(&dj);
+					}
+				} else
+#endif
+				{
+					res = move_window(fs, dj.sect);	/* Reload the directory sector */
+					if (res == FR_OK && obj.objsize != ld_32(dj.dir + DIR_FileSize)) {
+						st_32(dj.dir + DIR_FileSize, (DWORD)obj.objsize);
+						fs->wflag = 1;
+					}
+				}
+				if (res == FR_OK) {
+					res = sync_fs(fs);
+				}
+			}
+		}
+		FREE_NAMEBUFF();
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+#endif	/* !FF_FS_READONLY && FF_FS_LAZYSYNC */
+
+
+
 #if FF_USE_LABEL
 /*-----------------------------------------------------------------------*/
 /* API: Get Volume Label                                                 */
@@ -5726,7 +7157,7 @@ FRESULT f_setlabel (
 FRESULT f_expand (
 	FIL* fp,		/* Pointer to the file object */
 	FSIZE_t fsz,	/* File size to be expanded to */
-	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate (3:and fill it with zeros) */
 )
 {
 	FRESULT res;
@@ -5744,6 +7175,13 @@ FRESULT f_expand (
 	tcl = (DWORD)(fsz / n) + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
 	stcl = fs->last_clst; lclst = 0;
 	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+#if FF_FS_AUALIGN
+	if (fs->au_clst > 1 && tcl >= fs->au_clst) {	/* Start a large block on an AU boundary if possible */
+		scl = find_au(&fp->obj, stcl, tcl);
+		if (scl == 1 || scl == 0xFFFFFFFF) LEAVE_FF(fs, (scl == 1) ? FR_INT_ERR : FR_DISK_ERR);
+		if (scl >= 2) stcl = scl;	/* The search below finds it first */
+	}
+#endif
 
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {
@@ -5782,11 +7220,8 @@ FRESULT f_expand (
 		}
 		if (res == FR_OK) {	/* A contiguous free area is found */
 			if (opt) {		/* Allocate it now */
-				for (clst = scl, n = tcl; n; clst++, n--) {	/* Create a cluster chain on the FAT */
-					res = put_fat(fs, clst, (n == 1) ? 0xFFFFFFFF : clst + 1);
-					if (res != FR_OK) break;
-					lclst = clst;
-				}
+				res = put_fat_run(fs, scl, tcl, 0xFFFFFFFF);	/* Create a cluster chain on the FAT */
+				lclst = scl + tcl - 1;
 			} else {		/* Set it as suggested point for next allocation */
 				lclst = scl - 1;
 			}
@@ -5799,11 +7234,17 @@ FRESULT f_expand (
 			fp->obj.sclust = scl;		/* Update object allocation information */
 			fp->obj.objsize = fsz;
 			if (FF_FS_EXFAT) fp->obj.stat = 2;	/* Set status 'contiguous chain' */
+			fp->n_ctg = tcl;			/* The file is contiguous */
 			fp->flag |= FA_MODIFIED;
 			if (fs->free_clst <= fs->n_fatent - 2) {	/* Update FSINFO */
 				fs->free_clst -= tcl;
 				fs->fsi_flag |= 1;
 			}
+#if FF_USE_ZERO
+			if (opt & 2) {	/* Fill the block with zeros if requested */
+				res = fill_zero(fs, clst2sect(fs, scl), (LBA_t)tcl * fs->csize);
+			}
+#endif
 		}
 	}
 
@@ -5839,6 +7280,20 @@ FRESULT f_forward (
 	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
 	if (res != FR_OK || (res = (FRESULT)fp->err) != FR_OK) LEAVE_FF(fs, res);
 	if (!(fp->flag & FA_READ)) LEAVE_FF(fs, FR_DENIED);	/* Check access mode */
+#if !FF_FS_READONLY && !FF_FS_TINY && FF_USE_WBUF
+	if (flush_wbuf(fp) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Make the written sectors visible to disk_read */
+#endif
+#if !FF_FS_TINY && FF_USE_RBUF
+	if (fp->rbuf) {		/* Streaming mode? */
+#if !FF_FS_READONLY
+		if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
+			if (disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
+#endif
+		if (fp->rbofs == 0 && fp->n_rbsect > fp->sz_rbuf / 2) fp->n_rbsect = 0;	/* Discard the read-ahead data not fitting in a bank */
+	}
+#endif
 
 	remain = fp->obj.objsize - fp->fptr;
 	if (btf > remain) btf = (UINT)remain;			/* Truncate btf by remaining bytes */
@@ -5861,6 +7316,39 @@ FRESULT f_forward (
 		if (move_window(fs, sect) != FR_OK) ABORT(fs, FR_DISK_ERR);	/* Move sector window to the file data */
 		dbuf = fs->win;
 #else
+#if FF_USE_RBUF
+		if (fp->rbuf) {		/* Streaming mode: hand the sectors over in banks of the read-ahead buffer */
+			FSIZE_t ofs;
+			UINT n;
+
+			if (sect - fp->rbsect >= fp->n_rbsect) {	/* Not in the current bank? */
+				if (load_rbank(fp, fp->clust, sect, fp->fptr - fp->fptr % SS(fs)) != FR_OK) ABORT(fs, FR_DISK_ERR);
+			}
+			dbuf = fp->rbuf + (fp->rbofs + (UINT)(sect - fp->rbsect)) * SS(fs);
+			n = (UINT)(fp->rbsect + fp->n_rbsect - sect) * SS(fs) - (UINT)fp->fptr % SS(fs);	/* Number of bytes remains in the bank */
+			rcnt = (n > btf) ? btf : n;
+			rcnt = (*func)(dbuf + ((UINT)fp->fptr % SS(fs)), rcnt);	/* Forward the file data (the function can start a DMA transfer and return) */
+			if (rcnt == 0) ABORT(fs, FR_INT_ERR);
+			ofs = fp->fptr + rcnt;
+			fp->clust += (DWORD)((ofs - 1) / SS(fs) / fs->csize - fp->fptr / SS(fs) / fs->csize);	/* Track the current cluster (the sectors in a bank are contiguous) */
+			if (ofs % SS(fs)) {			/* Stopped in the middle of a sector? */
+				fp->sect = sect + (LBA_t)((ofs - 1) / SS(fs) - fp->fptr / SS(fs));
+				memcpy(fp->buf, dbuf + (UINT)(fp->sect - sect) * SS(fs), SS(fs));	/* Put it into the sector cache for the following access */
+			} else if (rcnt == n && ofs < fp->obj.objsize) {	/* Bank consumed: read the next bank while the data is in transfer */
+				clst = fp->clust;
+				sect = fp->rbsect + fp->n_rbsect;
+				if ((ofs / SS(fs) & (fs->csize - 1)) == 0) {	/* On the cluster boundary? */
+					clst = get_fat(&fp->obj, clst);
+					if (clst <= 1) ABORT(fs, FR_INT_ERR);
+					if (clst == 0xFFFFFFFF) ABORT(fs, FR_DISK_ERR);
+					sect = clst2sect(fs, clst);
+					if (sect == 0) ABORT(fs, FR_INT_ERR);
+				}
+				if (load_rbank(fp, clst, sect, ofs) != FR_OK) ABORT(fs, FR_DISK_ERR);
+			}
+			continue;
+		}
+#endif
 		if (fp->sect != sect) {		/* Fill sector cache with file data */
 #if !FF_FS_READONLY
 			if (fp->flag & FA_DIRTY) {		/* Write-back dirty sector cache */
@@ -6581,6 +8069,75 @@ FRESULT f_fdisk (
 #if FF_USE_LFN && FF_LFN_UNICODE && (FF_STRF_ENCODE < 0 || FF_STRF_ENCODE > 3)
 #error Wrong FF_STRF_ENCODE setting
 #endif
+/*-----------------------------------------------------------------------*/
+/* String functions - Read bytes out of the sector cache                 */
+/*-----------------------------------------------------------------------*/
+
+/* The sector cache holds the sector of fptr whenever fptr is not on the sector
+/  boundary (it is what f_read() relies on), so the bytes up to the end of the
+/  sector can be taken from the cache without going through f_read(). */
+
+#if FF_USE_LFN && FF_LFN_UNICODE
+static UINT gets_read (	/* Returns number of bytes read */
+	FIL* fp,		/* Pointer to the file object */
+	BYTE* s,		/* Buffer to store the read data */
+	UINT n			/* Number of bytes to read (1-4) */
+)
+{
+	UINT rc;
+#if !FF_FS_TINY
+	FATFS *fs = fp->obj.fs;
+	UINT ofs;
+
+
+	if (fs && fs->id == fp->obj.id && !fp->err && (fp->flag & FA_READ)) {
+		ofs = (UINT)(fp->fptr % SS(fs));
+		if (ofs != 0 && ofs + n <= SS(fs) && fp->fptr + n <= fp->obj.objsize) {	/* In the cached sector? */
+			memcpy(s, fp->buf + ofs, n);
+			fp->fptr += n;
+			return n;
+		}
+	}
+#endif
+	f_read(fp, s, n, &rc);	/* Get it in the regular way */
+	return rc;
+}
+
+#else
+static UINT gets_line (	/* Returns number of bytes read */
+	FIL* fp,		/* Pointer to the file object */
+	BYTE* s,		/* Buffer to store the read data */
+	UINT n			/* Size of the buffer (>=1) */
+)
+{
+	BYTE *cbuf, *lf;
+	UINT rc, ofs, nb;
+
+
+	f_read(fp, s, 1, &rc);	/* Get the first byte in the regular way (this loads the sector cache) */
+	if (rc != 1 || s[0] == '\n' || n == 1) return rc;
+
+#if FF_FS_TINY
+	cbuf = fp->obj.fs->win;
+#else
+	cbuf = fp->buf;
+#endif
+	ofs = (UINT)(fp->fptr % SS(fp->obj.fs));
+	if (ofs == 0) return 1;		/* The cached sector has been consumed */
+	nb = SS(fp->obj.fs) - ofs;	/* Bytes left in the cached sector */
+	if (nb > fp->obj.objsize - fp->fptr) nb = (UINT)(fp->obj.objsize - fp->fptr);
+	if (nb > n - 1) nb = n - 1;
+	lf = memchr(cbuf + ofs, '\n', nb);	/* Find the end of line in the cached sector */
+	if (lf) nb = (UINT)(lf - (cbuf + ofs)) + 1;
+	memcpy(s + 1, cbuf + ofs, nb);	/* Take the bytes up to the end of line */
+	fp->fptr += nb;
+	return nb + 1;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* API: Get a String from the File                                       */
 /*-----------------------------------------------------------------------*/
@@ -6593,9 +8150,11 @@ TCHAR* f_gets (
 {
 	int nc = 0;
 	TCHAR *p = buff;
-	BYTE s[4];
 	UINT rc;
 	DWORD dc;
+#if FF_USE_LFN && FF_LFN_UNICODE
+	BYTE s[4];
+#endif
 #if FF_USE_LFN && FF_LFN_UNICODE && FF_STRF_ENCODE <= 2
 	WCHAR wc;
 #endif
@@ -6610,30 +8169,30 @@ TCHAR* f_gets (
 	if (FF_LFN_UNICODE == 3) len -= 1;
 	while (nc < len) {
 #if FF_STRF_ENCODE == 0				/* Read a character in ANSI/OEM */
-		f_read(fp, s, 1, &rc);		/* Get a code unit */
+		rc = gets_read(fp, s, 1);		/* Get a code unit */
 		if (rc != 1) break;			/* EOF? */
 		wc = s[0];
 		if (dbc_1st((BYTE)wc)) {	/* DBC 1st byte? */
-			f_read(fp, s, 1, &rc);	/* Get 2nd byte */
+			rc = gets_read(fp, s, 1);	/* Get 2nd byte */
 			if (rc != 1 || !dbc_2nd(s[0])) continue;	/* Wrong code? */
 			wc = wc << 8 | s[0];
 		}
 		dc = ff_oem2uni(wc, CODEPAGE);	/* Convert ANSI/OEM into Unicode */
 		if (dc == 0) continue;		/* Conversion error? */
 #elif FF_STRF_ENCODE == 1 || FF_STRF_ENCODE == 2 	/* Read a character in UTF-16LE/BE */
-		f_read(fp, s, 2, &rc);		/* Get a code unit */
+		rc = gets_read(fp, s, 2);		/* Get a code unit */
 		if (rc != 2) break;			/* EOF? */
 		dc = (FF_STRF_ENCODE == 1) ? ld_16(s) : s[0] << 8 | s[1];
 		if (IsSurrogateL(dc)) continue;	/* Broken surrogate pair? */
 		if (IsSurrogateH(dc)) {		/* High surrogate? */
-			f_read(fp, s, 2, &rc);	/* Get low surrogate */
+			rc = gets_read(fp, s, 2);	/* Get low surrogate */
 			if (rc != 2) break;		/* EOF? */
 			wc = (FF_STRF_ENCODE == 1) ? ld_16(s) : s[0] << 8 | s[1];
 			if (!IsSurrogateL(wc)) continue;	/* Broken surrogate pair? */
 			dc = ((dc & 0x3FF) + 0x40) << 10 | (wc & 0x3FF);	/* Merge surrogate pair */
 		}
 #else	/* Read a character in UTF-8 */
-		f_read(fp, s, 1, &rc);		/* Get a code unit */
+		rc = gets_read(fp, s, 1);		/* Get a code unit */
 		if (rc != 1) break;			/* EOF? */
 		dc = s[0];
 		if (dc >= 0x80) {			/* Multi-byte sequence? */
@@ -6648,7 +8207,7 @@ TCHAR* f_gets (
 				dc &= 0x07; ct = 3;
 			}
 			if (ct == 0) continue;
-			f_read(fp, s, ct, &rc);	/* Get trailing bytes */
+			rc = gets_read(fp, s, ct);	/* Get trailing bytes */
 			if (rc != ct) break;
 			rc = 0;
 			do {	/* Merge the byte sequence */
@@ -6692,15 +8251,24 @@ TCHAR* f_gets (
 #endif
 	}
 
-#else			/* Byte-by-byte read without any conversion (ANSI/OEM API) */
+#else			/* Read without any conversion (ANSI/OEM API) */
 	len -= 1;	/* Make a room for the terminator */
 	while (nc < len) {
-		f_read(fp, s, 1, &rc);	/* Get a byte */
-		if (rc != 1) break;		/* EOF? */
-		dc = s[0];
-		if (FF_USE_STRFUNC == 2 && dc == '\r') continue;
-		*p++ = (TCHAR)dc; nc++;
-		if (dc == '\n') break;
+		rc = gets_line(fp, (BYTE*)p, (UINT)(len - nc));	/* Get bytes up to the end of line in the sector */
+		if (rc == 0) break;		/* EOF? */
+		dc = (BYTE)p[rc - 1];
+#if FF_USE_STRFUNC == 2
+		{	/* Strip \r off */
+			UINT si, di;
+
+			for (si = di = 0; si < rc; si++) {
+				if (p[si] != '\r') p[di++] = p[si];
+			}
+			rc = di;
+		}
+#endif
+		p += rc; nc += rc;
+		if (dc == '\n') break;	/* End of line? */
 	}
 #endif
 
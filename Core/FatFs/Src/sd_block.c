@@ -0,0 +1,636 @@
+/******************************************************************************
+ *  File        : sd_block.c (stackable block devices under diskio.c)
+ *  Author      : ControllersTech
+ *  Website     : https://controllerstech.com
+ *  Date        : June 26, 2025
+ *
+ *  Description :
+ *    This file is part of a custom STM32/Embedded tutorial series.
+ *    For documentation, updates, and more examples, visit the website above.
+ *
+ *  Note :
+ *    This code is written and maintained by ControllersTech.
+ *    You are free to use and modify it for learning and development.
+ ******************************************************************************/
+
+#include "sd_block.h"
+#include "sd_spi.h"
+#include "sd_stripe.h"
+#include <string.h>
+
+/***************************************************************
+ * 🚫 DO NOT MODIFY BELOW THIS LINE
+ * Auto-generated/system-managed code. Changes may be lost.
+ * The stacks themselves are set up in diskio.c.
+ ***************************************************************/
+
+/*-----------------------------------------------------------------------*/
+/* Dispatch: a NULL op is handled by the device below                    */
+/*-----------------------------------------------------------------------*/
+
+DSTATUS Block_Init(BlockDev *dev) {
+	if (!dev)
+		return STA_NOINIT;
+	if (dev->ops->init)
+		return dev->ops->init(dev);
+	return Block_Init(dev->lower);
+}
+
+DSTATUS Block_Status(BlockDev *dev) {
+	if (!dev)
+		return STA_NOINIT;
+	if (dev->ops->status)
+		return dev->ops->status(dev);
+	return Block_Status(dev->lower);
+}
+
+DRESULT Block_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	if (!dev)
+		return RES_PARERR;
+	if (dev->ops->read)
+		return dev->ops->read(dev, buff, sector, count);
+	return Block_Read(dev->lower, buff, sector, count);
+}
+
+DRESULT Block_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	if (!dev)
+		return RES_PARERR;
+	if (dev->ops->write)
+		return dev->ops->write(dev, buff, sector, count);
+	return Block_Write(dev->lower, buff, sector, count);
+}
+
+/* CTRL_SYNC goes to the flush op so that every layer sees it */
+DRESULT Block_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	if (!dev)
+		return RES_PARERR;
+	if (cmd == CTRL_SYNC)
+		return Block_Flush(dev);
+	if (dev->ops->ioctl)
+		return dev->ops->ioctl(dev, cmd, buff);
+	return Block_Ioctl(dev->lower, cmd, buff);
+}
+
+/* The bottom device gets CTRL_SYNC through its own ioctl */
+DRESULT Block_Flush(BlockDev *dev) {
+	if (!dev)
+		return RES_PARERR;
+	if (dev->ops->flush)
+		return dev->ops->flush(dev);
+	if (dev->lower)
+		return Block_Flush(dev->lower);
+	return dev->ops->ioctl ? dev->ops->ioctl(dev, CTRL_SYNC, NULL) : RES_OK;
+}
+
+/* Without a caps op at the bottom: any burst, no alignment, erase block from
+ * GET_BLOCK_SIZE */
+DRESULT Block_GetCaps(BlockDev *dev, BlockCaps *caps) {
+	DWORD blk;
+
+	if (!dev)
+		return RES_PARERR;
+	if (dev->ops->caps)
+		return dev->ops->caps(dev, caps);
+	if (dev->lower)
+		return Block_GetCaps(dev->lower, caps);
+
+	caps->max_burst = 0;
+	caps->align = 1;
+	caps->erase_unit = Block_Ioctl(dev, GET_BLOCK_SIZE, &blk) == RES_OK ? blk : 0;
+	return RES_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* SD card and striped cards                                             */
+/*-----------------------------------------------------------------------*/
+
+/* Only a card that is down is initialized again */
+static DSTATUS BlockSd_Init(BlockDev *dev) {
+	if (SD_status(dev->unit) & STA_NOINIT)
+		SD_SPI_Init(dev->unit);
+	return SD_status(dev->unit);
+}
+
+static DSTATUS BlockSd_Status(BlockDev *dev) {
+	return SD_status(dev->unit);
+}
+
+static DRESULT BlockSd_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	return SD_ReadBlocks(dev->unit, buff, sector, count);
+}
+
+static DRESULT BlockSd_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	return SD_WriteBlocks(dev->unit, buff, sector, count);
+}
+
+static DRESULT BlockSd_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	return SD_ioctl(dev->unit, cmd, buff);
+}
+
+/* The erase unit is the AU (SD status) or the CSD erase sector. A write burst
+ * within one AU runs at full speed, a longer one makes the card open the next. */
+static DRESULT BlockSd_Caps(BlockDev *dev, BlockCaps *caps) {
+	DWORD au;
+	DRESULT res = SD_ioctl(dev->unit, GET_BLOCK_SIZE, &au);
+
+	if (res != RES_OK)
+		return res;
+	caps->max_burst = au;
+	caps->align = 1;
+	caps->erase_unit = au;
+	return RES_OK;
+}
+
+const BlockOps block_sd_ops = {
+	.init = BlockSd_Init,
+	.status = BlockSd_Status,
+	.read = BlockSd_Read,
+	.write = BlockSd_Write,
+	.ioctl = BlockSd_Ioctl,
+	.caps = BlockSd_Caps,
+};
+
+static DSTATUS BlockStripe_Init(BlockDev *dev) {
+	(void)dev;
+	return SD_StripeInit();
+}
+
+static DSTATUS BlockStripe_Status(BlockDev *dev) {
+	(void)dev;
+	return SD_StripeStatus();
+}
+
+static DRESULT BlockStripe_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	(void)dev;
+	return SD_StripeRead(buff, sector, count);
+}
+
+static DRESULT BlockStripe_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	(void)dev;
+	return SD_StripeWrite(buff, sector, count);
+}
+
+static DRESULT BlockStripe_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	(void)dev;
+	return SD_StripeIoctl(cmd, buff);
+}
+
+static DRESULT BlockStripe_Caps(BlockDev *dev, BlockCaps *caps) {
+	(void)dev;
+	return SD_StripeCaps(caps);
+}
+
+const BlockOps block_stripe_ops = {
+	.init = BlockStripe_Init,
+	.status = BlockStripe_Status,
+	.read = BlockStripe_Read,
+	.write = BlockStripe_Write,
+	.ioctl = BlockStripe_Ioctl,
+	.caps = BlockStripe_Caps,
+};
+
+/*-----------------------------------------------------------------------*/
+/* RAM disk                                                              */
+/*-----------------------------------------------------------------------*/
+
+static DSTATUS BlockRam_Status(BlockDev *dev) {
+	BlockRam *ram = dev->ctx;
+
+	return ram->mem && ram->sectors ? 0 : STA_NOINIT;
+}
+
+static DRESULT BlockRam_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	BlockRam *ram = dev->ctx;
+
+	if (!count || sector >= ram->sectors || count > ram->sectors - sector)
+		return RES_PARERR;
+	memcpy(buff, ram->mem + sector * 512, count * 512);
+	return RES_OK;
+}
+
+static DRESULT BlockRam_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	BlockRam *ram = dev->ctx;
+
+	if (!count || sector >= ram->sectors || count > ram->sectors - sector)
+		return RES_PARERR;
+	memcpy(ram->mem + sector * 512, buff, count * 512);
+	return RES_OK;
+}
+
+static DRESULT BlockRam_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	BlockRam *ram = dev->ctx;
+	LBA_t *dp = buff;
+
+	switch (cmd) {
+	case CTRL_SYNC:
+		return RES_OK;
+
+	case GET_SECTOR_COUNT:
+		*(LBA_t*) buff = ram->sectors;
+		return RES_OK;
+
+	case GET_SECTOR_SIZE:
+		*(WORD*) buff = 512;
+		return RES_OK;
+
+	case GET_BLOCK_SIZE:
+		*(DWORD*) buff = 1;
+		return RES_OK;
+
+	case CTRL_TRIM: // Nothing to erase, the data may stay
+		return RES_OK;
+
+	case CTRL_ZERO:
+		if (dp[1] < dp[0] || dp[1] >= ram->sectors)
+			return RES_PARERR;
+		memset(ram->mem + dp[0] * 512, 0, (dp[1] - dp[0] + 1) * 512);
+		return RES_OK;
+
+	default:
+		return RES_PARERR;
+	}
+}
+
+const BlockOps block_ram_ops = {
+	.init = BlockRam_Status,
+	.status = BlockRam_Status,
+	.read = BlockRam_Read,
+	.write = BlockRam_Write,
+	.ioctl = BlockRam_Ioctl,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Stats: request counters and a trace of the last requests              */
+/*-----------------------------------------------------------------------*/
+
+static void BlockStats_Log(BlockStats *st, BYTE op, LBA_t sector, UINT count, DRESULT res, uint32_t start) {
+	BlockTraceEntry *e = &st->trace[st->trace_n++ % BLOCK_TRACE];
+
+	e->tick = start;
+	e->op = op;
+	e->res = res;
+	e->sector = sector;
+	e->count = count;
+	e->ms = HAL_GetTick() - start;
+	if (res != RES_OK)
+		st->errors++;
+}
+
+static DRESULT BlockStats_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	BlockStats *st = dev->ctx;
+	uint32_t start = HAL_GetTick();
+	DRESULT res = Block_Read(dev->lower, buff, sector, count);
+
+	BlockStats_Log(st, 'R', sector, count, res, start);
+	st->reads++;
+	st->read_sectors += count;
+	st->read_ms += HAL_GetTick() - start;
+	return res;
+}
+
+static DRESULT BlockStats_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	BlockStats *st = dev->ctx;
+	uint32_t start = HAL_GetTick();
+	DRESULT res = Block_Write(dev->lower, buff, sector, count);
+
+	BlockStats_Log(st, 'W', sector, count, res, start);
+	st->writes++;
+	st->write_sectors += count;
+	st->write_ms += HAL_GetTick() - start;
+	return res;
+}
+
+static DRESULT BlockStats_Flush(BlockDev *dev) {
+	BlockStats *st = dev->ctx;
+	uint32_t start = HAL_GetTick();
+	DRESULT res = Block_Flush(dev->lower);
+
+	BlockStats_Log(st, 'S', 0, 0, res, start);
+	st->flushes++;
+	st->flush_ms += HAL_GetTick() - start;
+	return res;
+}
+
+static DRESULT BlockStats_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	BlockStats *st = dev->ctx;
+
+	if (cmd == BLOCK_GET_STATS) {
+		memcpy(buff, st, sizeof(BlockStats));
+		return RES_OK;
+	}
+	st->ioctls++;
+	return Block_Ioctl(dev->lower, cmd, buff);
+}
+
+const BlockOps block_stats_ops = {
+	.read = BlockStats_Read,
+	.write = BlockStats_Write,
+	.ioctl = BlockStats_Ioctl,
+	.flush = BlockStats_Flush,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Cache: set-associative, write-back                                    */
+/*-----------------------------------------------------------------------*/
+
+/* Slot holding sector, -1 if none */
+static int BlockCache_Find(BlockCache *c, LBA_t sector) {
+	UINT i = sector % BLOCK_CACHE_SETS;
+
+	for (UINT w = 0; w < BLOCK_CACHE_WAYS; w++, i += BLOCK_CACHE_SETS) {
+		if (c->line[i].valid && c->line[i].sector == sector)
+			return i;
+	}
+	return -1;
+}
+
+static void BlockCache_Drop(BlockCache *c, UINT i) {
+	if (c->line[i].dirty)
+		c->st.dirty--;
+	c->line[i].valid = c->line[i].dirty = 0;
+}
+
+/* Swaps two slots of one set, any sector may be in either of them */
+static void BlockCache_Swap(BlockCache *c, UINT a, UINT b) {
+	BlockCacheLine t = c->line[a];
+	uint32_t *pa = (uint32_t*) c->data[a], *pb = (uint32_t*) c->data[b], w;
+
+	c->line[a] = c->line[b];
+	c->line[b] = t;
+	for (UINT n = 0; n < 512 / 4; n++) {
+		w = pa[n];
+		pa[n] = pb[n];
+		pb[n] = w;
+	}
+}
+
+/* Writes back the dirty run around slot i, lowest sector first. Its sectors are
+ * moved into consecutive slots first, the run is split only where that would go
+ * past the last slot or the burst limit of the device. */
+static DRESULT BlockCache_WriteRun(BlockDev *dev, UINT i) {
+	BlockCache *c = dev->ctx;
+	LBA_t st = c->line[i].sector, ed = st;
+	int j, k;
+	UINT n;
+	DRESULT res;
+
+	while (st > 0 && (j = BlockCache_Find(c, st - 1)) >= 0 && c->line[j].dirty)
+		st--;
+	while ((j = BlockCache_Find(c, ed + 1)) >= 0 && c->line[j].dirty)
+		ed++;
+
+	while (st <= ed) {
+		j = BlockCache_Find(c, st);
+		for (n = 1; st + n <= ed && j + n < BLOCK_CACHE_SLOTS && (!c->max_burst || n < c->max_burst); n++) {
+			k = BlockCache_Find(c, st + n);
+			if (k != j + (int) n)
+				BlockCache_Swap(c, k, j + n);
+		}
+		res = Block_Write(dev->lower, c->data[j], st, n);
+		if (res != RES_OK)
+			return res;
+		c->st.writebacks++;
+		c->st.written += n;
+		c->st.dirty -= n;
+		for (; n; n--, j++, st++)
+			c->line[j].dirty = 0;
+	}
+	return RES_OK;
+}
+
+/* Writes back the least recently used runs until at most keep sectors are dirty */
+static DRESULT BlockCache_Clean(BlockDev *dev, UINT keep) {
+	BlockCache *c = dev->ctx;
+	DRESULT res;
+	int old;
+
+	while (c->st.dirty > keep) {
+		old = -1;
+		for (UINT i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+			if (c->line[i].dirty && (old < 0 || c->line[i].used < c->line[old].used))
+				old = i;
+		}
+		res = BlockCache_WriteRun(dev, old);
+		if (res != RES_OK)
+			return res;
+	}
+	return RES_OK;
+}
+
+/* Slot for a new sector, in its set: next to the slot of the sector before or
+ * after it if that keeps a run together in memory, else a free slot, else the
+ * least recently used one, clean if possible. A dirty one is written back first.
+ * Returns -1 on a write error. */
+static int BlockCache_Alloc(BlockDev *dev, LBA_t sector) {
+	BlockCache *c = dev->ctx;
+	UINT set = sector % BLOCK_CACHE_SETS;
+	int i = -1, k;
+
+	if ((k = BlockCache_Find(c, sector - 1)) >= 0 && k + 1 < BLOCK_CACHE_SLOTS && !c->line[k + 1].dirty)
+		i = k + 1;
+	else if ((k = BlockCache_Find(c, sector + 1)) > 0 && !c->line[k - 1].dirty)
+		i = k - 1;
+	if (i < 0) {
+		for (UINT j = set; j < BLOCK_CACHE_SLOTS; j += BLOCK_CACHE_SETS) {
+			if (!c->line[j].valid) {
+				i = j;
+				break;
+			}
+			if (i < 0 || c->line[j].dirty < c->line[i].dirty
+					|| (c->line[j].dirty == c->line[i].dirty && c->line[j].used < c->line[i].used))
+				i = j;
+		}
+	}
+
+	while (c->line[i].dirty) { // The write-back may move another dirty sector in
+		if (BlockCache_WriteRun(dev, i) != RES_OK)
+			return -1;
+	}
+	if (c->line[i].valid)
+		c->st.evictions++;
+	c->line[i].valid = 0;
+	c->line[i].sector = sector;
+	return i;
+}
+
+/* Cached sectors are dropped if the card went down, a new one may be in the
+ * socket. Dirty ones among them are counted in st.lost, and the drive stays
+ * down until the application has seen the loss and cleared it
+ * (BLOCK_CLEAR_LOST), so a retried mount does not go on without them. */
+static DSTATUS BlockCache_Init(BlockDev *dev) {
+	BlockCache *c = dev->ctx;
+	BlockCaps caps;
+	DSTATUS stat;
+
+	if (Block_Status(dev->lower) & STA_NOINIT) {
+		c->st.lost += c->st.dirty;
+		for (UINT i = 0; i < BLOCK_CACHE_SLOTS; i++)
+			BlockCache_Drop(c, i);
+	}
+
+	stat = Block_Init(dev->lower);
+	if (!(stat & STA_NOINIT) && Block_GetCaps(dev->lower, &caps) == RES_OK)
+		c->max_burst = caps.max_burst;
+	return c->st.lost ? stat | STA_NOINIT : stat;
+}
+
+static DSTATUS BlockCache_Status(BlockDev *dev) {
+	BlockCache *c = dev->ctx;
+	DSTATUS stat = Block_Status(dev->lower);
+
+	return c->st.lost ? stat | STA_NOINIT : stat;
+}
+
+static DRESULT BlockCache_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	BlockCache *c = dev->ctx;
+	DRESULT res;
+	int i;
+
+	if (count != 1) { // Read through, newer data from dirty slots on top
+		res = Block_Read(dev->lower, buff, sector, count);
+		for (i = 0; res == RES_OK && i < BLOCK_CACHE_SLOTS; i++) {
+			if (c->line[i].dirty && c->line[i].sector >= sector && c->line[i].sector - sector < count)
+				memcpy(buff + (c->line[i].sector - sector) * 512, c->data[i], 512);
+		}
+		return res;
+	}
+
+	i = BlockCache_Find(c, sector);
+	if (i >= 0) {
+		c->st.hits++;
+	} else {
+		c->st.misses++;
+		i = BlockCache_Alloc(dev, sector);
+		if (i < 0)
+			return RES_ERROR;
+		res = Block_Read(dev->lower, c->data[i], sector, 1);
+		if (res != RES_OK)
+			return res;
+		c->line[i].valid = 1;
+	}
+	c->line[i].used = ++c->clock;
+	memcpy(buff, c->data[i], 512);
+	return RES_OK;
+}
+
+static DRESULT BlockCache_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	BlockCache *c = dev->ctx;
+	DRESULT res;
+	int i;
+
+	if (count != 1) { // Write through, cached copies take the new data
+		res = Block_Write(dev->lower, buff, sector, count);
+		for (i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+			if (c->line[i].valid && c->line[i].sector >= sector && c->line[i].sector - sector < count) {
+				if (res != RES_OK) {
+					BlockCache_Drop(c, i);
+					continue;
+				}
+				memcpy(c->data[i], buff + (c->line[i].sector - sector) * 512, 512);
+				if (c->line[i].dirty) {
+					c->line[i].dirty = 0;
+					c->st.dirty--;
+				}
+			}
+		}
+		return res;
+	}
+
+	i = BlockCache_Find(c, sector);
+	if (i >= 0) {
+		c->st.hits++;
+		if (c->line[i].dirty)
+			c->st.absorbed++;
+	} else {
+		c->st.misses++;
+		i = BlockCache_Alloc(dev, sector);
+		if (i < 0)
+			return RES_ERROR;
+		c->line[i].valid = 1;
+	}
+	memcpy(c->data[i], buff, 512);
+	c->line[i].used = ++c->clock;
+	if (!c->line[i].dirty) {
+		c->line[i].dirty = 1;
+		c->st.dirty++;
+	}
+
+	return c->st.dirty >= c->hi_mark ? BlockCache_Clean(dev, c->lo_mark) : RES_OK;
+}
+
+static DRESULT BlockCache_Flush(BlockDev *dev) {
+	DRESULT res = BlockCache_Clean(dev, 0);
+
+	if (res != RES_OK)
+		return res;
+	return Block_Flush(dev->lower);
+}
+
+/* Trimmed or zeroed sectors are dropped, dirty or not */
+static DRESULT BlockCache_Ioctl(BlockDev *dev, BYTE cmd, void *buff) {
+	BlockCache *c = dev->ctx;
+	LBA_t *dp = buff;
+
+	switch (cmd) {
+	case BLOCK_GET_CACHE:
+		memcpy(buff, &c->st, sizeof(BlockCacheStats));
+		return RES_OK;
+
+	case BLOCK_CLEAR_LOST:
+		c->st.lost = 0;
+		return RES_OK;
+
+	case CTRL_TRIM:
+	case CTRL_ZERO:
+		for (UINT i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+			if (c->line[i].valid && c->line[i].sector >= dp[0] && c->line[i].sector <= dp[1])
+				BlockCache_Drop(c, i);
+		}
+		break;
+	}
+	return Block_Ioctl(dev->lower, cmd, buff);
+}
+
+const BlockOps block_cache_ops = {
+	.init = BlockCache_Init,
+	.status = BlockCache_Status,
+	.read = BlockCache_Read,
+	.write = BlockCache_Write,
+	.ioctl = BlockCache_Ioctl,
+	.flush = BlockCache_Flush,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Fault injection                                                       */
+/*-----------------------------------------------------------------------*/
+
+static uint8_t BlockFault_Hit(BlockFault *f, LBA_t sector, UINT count) {
+	f->requests++;
+	if ((f->every && f->requests % f->every == 0)
+			|| (f->bad_ed >= f->bad_st && sector <= f->bad_ed && sector + count > f->bad_st)) {
+		f->injected++;
+		return 1;
+	}
+	return 0;
+}
+
+static DRESULT BlockFault_Read(BlockDev *dev, BYTE *buff, LBA_t sector, UINT count) {
+	BlockFault *f = dev->ctx;
+
+	if (!f->writes_only && BlockFault_Hit(f, sector, count))
+		return RES_ERROR;
+	return Block_Read(dev->lower, buff, sector, count);
+}
+
+static DRESULT BlockFault_Write(BlockDev *dev, const BYTE *buff, LBA_t sector, UINT count) {
+	BlockFault *f = dev->ctx;
+
+	if (BlockFault_Hit(f, sector, count))
+		return RES_ERROR;
+	return Block_Write(dev->lower, buff, sector, count);
+}
+
+const BlockOps block_fault_ops = {
+	.read = BlockFault_Read,
+	.write = BlockFault_Write,
+};
@@ -25,21 +25,85 @@
 
 #define USE_DMA 1
 
-#define SD_CS_LOW()     HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_RESET)
-#define SD_CS_HIGH()    HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_SET)
+#define TRIM_QUEUE 8          // Freed ranges held for erasing in idle time (CTRL_IDLE)
+#define TRIM_MAX_SECTORS 8192 // Largest range erased by one CMD38 (4 MB), bounds the busy time
+
+#define SD_POWERUP_MS 100     // Supply settle time after reset before the card is clocked
+#define SD_INIT_TIMEOUT 1000  // ACMD41 retry window in ms
+
+#define SD_CD_DEBOUNCE_MS 50  // An inserted card is used once the switch is stable this long
+
+#define SD_CS_LOW(hw)   HAL_GPIO_WritePin((hw)->cs_port, (hw)->cs_pin, GPIO_PIN_RESET)
+#define SD_CS_HIGH(hw)  HAL_GPIO_WritePin((hw)->cs_port, (hw)->cs_pin, GPIO_PIN_SET)
+
+/* Card sockets, drive number = index. Cards may share an SPI bus, each one has
+ * its own CS and clock; cards on different buses transfer in parallel (see
+ * SD_ReadParallel). Card-detect switches read low with a card, set cd_port to
+ * NULL for a socket without one. SPI1 runs from 96 MHz, SPI2 from 48 MHz. */
+static const SD_Socket sd_socket[] = {
+	{ &SD_SPI_HANDLE, SD_CS_GPIO_Port, SD_CS_Pin, SD_CD_GPIO_Port, SD_CD_Pin, SPI_BAUDRATEPRESCALER_8 },
+	{ &SD2_SPI_HANDLE, SD2_CS_GPIO_Port, SD2_CS_Pin, SD2_CD_GPIO_Port, SD2_CD_Pin, SPI_BAUDRATEPRESCALER_4 },
+};
 
 /***************************************************************
  * 🚫 DO NOT MODIFY BELOW THIS LINE
  * Auto-generated/system-managed code. Changes may be lost.
  ***************************************************************/
-static volatile DSTATUS Stat = STA_NOINIT; /* Physical drive status */
-BYTE CardType; /* Card type flags */
-static uint8_t sdhc = 0;
+#define SD_CARDS (sizeof(sd_socket) / sizeof(sd_socket[0]))
+#define SD_CLK_SLOW SPI_BAUDRATEPRESCALER_256 /* 375 KBits/s on SPI1, 187 on SPI2, for the init */
+
+/* Driver state of one card */
+typedef struct {
+	const SD_Socket *hw;
+	volatile DSTATUS stat; /* Physical drive status */
+	BYTE type; /* Card type flags */
+	uint8_t sdhc; /* Block addressing */
+	uint32_t clk; /* SPI prescaler for this card, slow until it is initialized */
+	int8_t erase_zero; /* Erased blocks read as 0x00 (SCR DATA_STAT_AFTER_ERASE = 0), -1: not read yet */
+	DWORD erase_unit; /* Erase unit in sectors (CSD SECTOR_SIZE), 0: not read yet */
+	DWORD trim_st[TRIM_QUEUE], trim_ed[TRIM_QUEUE]; /* Freed ranges waiting to be erased */
+	uint8_t n_trim;
+	uint8_t trim_busy; /* An erase started in idle time may still be running */
+	SD_Status status; /* Parsed SD status (ACMD13) */
+	uint8_t status_valid;
+	volatile SD_InitState init_state; /* Asynchronous init state (SD_InitPoll) */
+	uint8_t init_step;
+	DRESULT init_res;
+	uint32_t init_timeout, init_tick; /* ACMD41 retry window end, last ACMD41 tick */
+	uint32_t init_arg; /* ACMD41 argument, HCS set for v2 cards */
+	SD_InitCallback init_done;
+	uint8_t spi_fault; /* A transfer failed in the SPI/DMA layer, see SD_Recover() */
+	SD_Stats stats; /* Error recovery counters */
+	uint8_t cid[16]; /* CID of the initialized card, tells a swapped card apart */
+	volatile uint8_t cd_removed; /* Removal edge seen by the EXTI callback */
+	volatile uint8_t cd_event; /* Switch changed and not debounced yet */
+	volatile uint32_t cd_tick; /* Time of the last edge */
+	volatile uint8_t dma_busy; /* DMA transfer of this card in flight */
+	uint32_t dma_timeout;
+} SD_Card;
+
+static SD_Card sd_card[SD_CARDS];
+static uint8_t zero_src = 0; /* Fixed DMA source for CTRL_ZERO writes */
+
+enum { INIT_POWERUP, INIT_CMD0, INIT_CMD8, INIT_ACMD41, INIT_CMD58 }; /* Init steps */
+
+/* Context of a drive number, set up on first use */
+static SD_Card* SD_GetCard(BYTE pdrv) {
+	SD_Card *card;
+
+	if (pdrv >= SD_CARDS)
+		return NULL;
+	card = &sd_card[pdrv];
+	if (!card->hw) {
+		card->hw = &sd_socket[pdrv];
+		card->stat = STA_NOINIT;
+		card->init_res = RES_NOTRDY;
+		card->cd_event = 1; /* Read the switch at boot */
+	}
+	return card;
+}
 
 #if USE_DMA
-volatile int dma_tx_done = 0;
-volatile int dma_rx_done = 0;
-
 /* DMA buffer placed in special RAM section for optimal DMA performance
  * Aligned to 32 bytes for cache coherency on ARM Cortex-M processors
  * Note: This buffer MUST be initialized at runtime since it's in NOLOAD section */
@@ -56,145 +120,240 @@ static void SD_InitDmaBuffer(void) {
 	}
 }
 
+/* End the transfer of the card that started DMA on this bus (one at a time per bus) */
+static void SD_DmaDone(SPI_HandleTypeDef *hspi) {
+	for (BYTE i = 0; i < SD_CARDS; i++) {
+		if (sd_card[i].dma_busy && sd_card[i].hw->spi == hspi)
+			sd_card[i].dma_busy = 0;
+	}
+}
+
 void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
-	if (hspi == &SD_SPI_HANDLE)
-		dma_tx_done = 1;
+	SD_DmaDone(hspi);
 }
 
 void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
-	if (hspi == &SD_SPI_HANDLE)
-		dma_rx_done = 1;
+	SD_DmaDone(hspi);
 }
 
 void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
-	if (hspi == &SD_SPI_HANDLE) {
-		/* Set done flags to unblock waiting loops */
-		dma_tx_done = 1;
-		dma_rx_done = 1;
-	}
+	SD_DmaDone(hspi); /* Unblock the waiting loop, ErrorCode tells it failed */
 }
 #endif
 
-/* Reset SPI peripherals after error to recover from hung state */
-static void SD_ResetSpiDma(void) {
+static uint8_t SD_CardPresent(SD_Card *card) {
+	if (!card->hw->cd_port)
+		return 1;
+	return HAL_GPIO_ReadPin(card->hw->cd_port, card->hw->cd_pin) == GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
+	SD_Card *card;
+
+	for (BYTE i = 0; i < SD_CARDS; i++) {
+		card = SD_GetCard(i);
+		if (card->hw->cd_port && GPIO_Pin == card->hw->cd_pin) {
+			card->cd_tick = HAL_GetTick();
+			card->cd_event = 1;
+			if (!SD_CardPresent(card))
+				card->cd_removed = 1; /* Acted on at once, without debouncing */
+		}
+	}
+}
+
+/* Fold card-detect events into the status: a removal takes the card down at once,
+ * an inserted card is accepted when the switch has settled */
+static void SD_CardDetect(SD_Card *card) {
+	if (card->cd_removed) {
+		card->cd_removed = 0;
+		card->stat |= STA_NODISK | STA_NOINIT;
+	}
+	if (card->cd_event && HAL_GetTick() - card->cd_tick >= SD_CD_DEBOUNCE_MS) {
+		card->cd_event = 0;
+		if (SD_CardPresent(card))
+			card->stat &= ~STA_NODISK;
+		else
+			card->stat |= STA_NODISK | STA_NOINIT;
+	}
+}
+
+/* Select the card, with the bus clocked at its own rate */
+static void SD_Select(SD_Card *card) {
+	MODIFY_REG(card->hw->spi->Instance->CR1, SPI_BAUDRATEPRESCALER_256, card->clk);
+	SD_CS_LOW(card->hw);
+}
+
+/* Reset SPI peripherals after error to recover from hung state.
+ * The card keeps its state, SD_Recover() decides whether it needs a new init. */
+static void SD_ResetSpiDma(SD_Card *card) {
 	/* Abort any ongoing SPI/DMA transfers before resetting peripherals */
-	HAL_SPI_Abort(&SD_SPI_HANDLE);
+	HAL_SPI_Abort(card->hw->spi);
 
 #if USE_DMA
 	/* DeInit DMA streams to fully reset their state */
-	HAL_DMA_DeInit(SD_SPI_HANDLE.hdmarx);
-	HAL_DMA_DeInit(SD_SPI_HANDLE.hdmatx);
+	HAL_DMA_DeInit(card->hw->spi->hdmarx);
+	HAL_DMA_DeInit(card->hw->spi->hdmatx);
 #endif
 
 	/* Reset SPI peripheral hardware via RCC */
-	__HAL_RCC_SPI1_FORCE_RESET();
-	__HAL_RCC_SPI1_RELEASE_RESET();
+	if (card->hw->spi->Instance == SPI1) {
+		__HAL_RCC_SPI1_FORCE_RESET();
+		__HAL_RCC_SPI1_RELEASE_RESET();
+	}
+#ifdef SPI2
+	else if (card->hw->spi->Instance == SPI2) {
+		__HAL_RCC_SPI2_FORCE_RESET();
+		__HAL_RCC_SPI2_RELEASE_RESET();
+	}
+#endif
+#ifdef SPI3
+	else if (card->hw->spi->Instance == SPI3) {
+		__HAL_RCC_SPI3_FORCE_RESET();
+		__HAL_RCC_SPI3_RELEASE_RESET();
+	}
+#endif
 
 	/* Reset HAL handle state so HAL_SPI_Init calls HAL_SPI_MspInit
 	 * to fully reinitialize SPI and DMA peripherals */
-	SD_SPI_HANDLE.State = HAL_SPI_STATE_RESET;
+	card->hw->spi->State = HAL_SPI_STATE_RESET;
 
 #if USE_DMA
-	/* Reset DMA flags */
-	dma_tx_done = 0;
-	dma_rx_done = 0;
+	/* Drop the transfers that were in flight on this bus */
+	for (BYTE i = 0; i < SD_CARDS; i++) {
+		if (sd_card[i].hw && sd_card[i].hw->spi == card->hw->spi)
+			sd_card[i].dma_busy = 0;
+	}
 #endif
 
-	/* Mark card as not initialized - requires re-initialization after error */
-	Stat = STA_NOINIT;
-
 	/* Small delay to ensure hardware is stable */
 	HAL_Delay(1);
 
 	/* Reinitialize SPI (HAL_SPI_MspInit reinitializes DMA and links it) */
-	HAL_SPI_Init(&SD_SPI_HANDLE);
+	HAL_SPI_Init(card->hw->spi);
 }
 
-static void SD_TransmitByte(uint8_t data) {
-	HAL_SPI_Transmit(&SD_SPI_HANDLE, &data, 1, HAL_MAX_DELAY);
+#if USE_DMA
+/* Stop a failed transfer, the peripheral is restarted by SD_Recover(card) */
+static uint8_t SD_TransferError(SD_Card *card) {
+	HAL_SPI_Abort(card->hw->spi);
+	card->spi_fault = 1;
+	return 1;
+}
+#endif
+
+static void SD_TransmitByte(SD_Card *card, uint8_t data) {
+	HAL_SPI_Transmit(card->hw->spi, &data, 1, HAL_MAX_DELAY);
 }
 
-static uint8_t SD_ReceiveByte(void) {
+static uint8_t SD_ReceiveByte(SD_Card *card) {
 	uint8_t dummy = 0xFF, data = 0;
-	HAL_SPI_TransmitReceive(&SD_SPI_HANDLE, &dummy, &data, 1, HAL_MAX_DELAY);
+	HAL_SPI_TransmitReceive(card->hw->spi, &dummy, &data, 1, HAL_MAX_DELAY);
 	return data;
 }
 
-static uint8_t SD_TransmitBuffer(const uint8_t *buffer, uint16_t len) {
-	HAL_StatusTypeDef res = HAL_ERROR;
+/* Start sending (rx NULL) or receiving a block, SD_WaitBuffer() waits for the end.
+ * Cards on other buses can be served while the DMA runs. */
+static uint8_t SD_StartBuffer(SD_Card *card, const uint8_t *tx, uint8_t *rx, uint16_t len) {
+	HAL_StatusTypeDef res = HAL_OK;
 
 #if USE_DMA
-	uint32_t timeout = HAL_GetTick() + 1000; /* 1 second timeout */
-	dma_tx_done = 0;
-	res = HAL_SPI_Transmit_DMA(&SD_SPI_HANDLE, (uint8_t*) buffer, len);
+	card->dma_timeout = HAL_GetTick() + 100; /* 512 bytes take 15 ms even at the slow clock */
+	card->dma_busy = 1;
+	if (rx) {
+		SD_InitDmaBuffer(); /* Ensure DMA buffer is initialized */
+		res = HAL_SPI_TransmitReceive_DMA(card->hw->spi, (uint8_t*) tx_dummy_512, rx, len);
+	} else {
+		res = HAL_SPI_Transmit_DMA(card->hw->spi, (uint8_t*) tx, len);
+	}
 	if (res != HAL_OK) {
-		SD_ResetSpiDma();
-		return 1;
+		card->dma_busy = 0;
+		return SD_TransferError(card);
 	}
-	while (!dma_tx_done) {
-		if (HAL_GetTick() > timeout) {
-			SD_ResetSpiDma();
-			return 1;
+#else
+	if (rx) {
+		for (uint16_t i = 0; i < len; i++) {
+			rx[i] = SD_ReceiveByte(card);
 		}
+	} else {
+		res = HAL_SPI_Transmit(card->hw->spi, (uint8_t*) tx, len, HAL_MAX_DELAY);
 	}
-	/* Check for SPI errors */
-	if (SD_SPI_HANDLE.ErrorCode != HAL_SPI_ERROR_NONE) {
-		SD_ResetSpiDma();
-		return 1;
-	}
-#else
-    res = HAL_SPI_Transmit(&SD_SPI_HANDLE, (uint8_t *)buffer, len, HAL_MAX_DELAY);
 #endif
 	return res != HAL_OK ? 1 : 0;
 }
 
-static uint8_t SD_ReceiveBuffer(uint8_t *buffer, uint16_t len) {
-	HAL_StatusTypeDef res = HAL_OK;
+static uint8_t SD_WaitBuffer(SD_Card *card) {
 #if USE_DMA
-	uint32_t timeout = HAL_GetTick() + 1000; /* 1 second timeout */
-	SD_InitDmaBuffer(); /* Ensure DMA buffer is initialized */
-	dma_rx_done = 0;
-	res = HAL_SPI_TransmitReceive_DMA(&SD_SPI_HANDLE, (uint8_t*) tx_dummy_512,
-			buffer, len);
-	if (res != HAL_OK) {
-		SD_ResetSpiDma();
-		return 1;
-	}
-	while (!dma_rx_done) {
-		if (HAL_GetTick() > timeout) {
-			SD_ResetSpiDma();
-			return 1;
+	while (card->dma_busy) {
+		if (HAL_GetTick() > card->dma_timeout) {
+			card->dma_busy = 0;
+			return SD_TransferError(card);
 		}
 	}
 	/* Check for SPI errors */
-	if (SD_SPI_HANDLE.ErrorCode != HAL_SPI_ERROR_NONE) {
-		SD_ResetSpiDma();
+	if (card->hw->spi->ErrorCode != HAL_SPI_ERROR_NONE)
+		return SD_TransferError(card);
+#endif
+	return 0;
+}
+
+static uint8_t SD_TransmitBuffer(SD_Card *card, const uint8_t *buffer, uint16_t len) {
+	if (SD_StartBuffer(card, buffer, NULL, len))
 		return 1;
-	}
+	return SD_WaitBuffer(card);
+}
+
+static uint8_t SD_ReceiveBuffer(SD_Card *card, uint8_t *buffer, uint16_t len) {
+	if (SD_StartBuffer(card, NULL, buffer, len))
+		return 1;
+	return SD_WaitBuffer(card);
+}
+
+static uint8_t SD_TransmitZeros(SD_Card *card, uint16_t len) {
+	uint8_t res;
+
+#if USE_DMA
+	/* Send the same zero byte over and over: no memory increment on the TX stream */
+	CLEAR_BIT(card->hw->spi->hdmatx->Instance->CR, DMA_SxCR_MINC);
+	res = SD_TransmitBuffer(card, &zero_src, len);
+	SET_BIT(card->hw->spi->hdmatx->Instance->CR, DMA_SxCR_MINC);
 #else
-    for (uint16_t i = 0; i < len; i++) {
-        buffer[i] = SD_ReceiveByte();
-    }
+	res = 0;
+	for (uint16_t i = 0; i < len; i++) {
+		SD_TransmitByte(card, zero_src);
+	}
 #endif
-	return res != HAL_OK ? 1 : 0;
+	return res;
 }
 
-static DRESULT SD_WaitReady(uint32_t delay) {
+static DRESULT SD_WaitReady(SD_Card *card, uint32_t delay) {
 	uint32_t timeout = HAL_GetTick() + delay;
 	uint8_t resp;
 	do {
-		resp = SD_ReceiveByte();
+		resp = SD_ReceiveByte(card);
 		if (resp == 0xFF)
 			return RES_OK;
 	} while (HAL_GetTick() < timeout);
 	return RES_ERROR;
 }
 
-static uint8_t SD_SendCommand(uint8_t cmd, uint32_t arg, uint8_t crc) {
+static uint8_t SD_SendCommand(SD_Card *card, uint8_t cmd, uint32_t arg, uint8_t crc) {
 	uint8_t response, retry = 0xFF;
 	uint8_t cmd_buf[6];
 
-	SD_WaitReady(500);
+	if (cmd & 0x80) { /* Send CMD55 ahead of an ACMD */
+		cmd &= 0x7F;
+		response = SD_SendCommand(card, CMD55, 0, 0xFF);
+		if (response > 1)
+			return response;
+	}
+
+	/* The busy time of the last write, stop token or erase ends here. CMD12 is sent
+	 * while the card streams read data, it has nothing to wait for. */
+	if (cmd != CMD12) {
+		if (SD_WaitReady(card, card->trim_busy ? 30000 : 500) != RES_OK) /* An idle time erase can take longer than a write */
+			return 0xFF;
+		card->trim_busy = 0;
+	}
 
 	/* Build command packet in buffer for single transfer */
 	cmd_buf[0] = 0x40 | cmd;
@@ -204,274 +363,619 @@ static uint8_t SD_SendCommand(uint8_t cmd, uint32_t arg, uint8_t crc) {
 	cmd_buf[4] = (uint8_t) arg;
 	cmd_buf[5] = crc;
 
-	HAL_SPI_Transmit(&SD_SPI_HANDLE, cmd_buf, 6, HAL_MAX_DELAY);
+	HAL_SPI_Transmit(card->hw->spi, cmd_buf, 6, HAL_MAX_DELAY);
 
 	do {
-		response = SD_ReceiveByte();
+		response = SD_ReceiveByte(card);
 	} while ((response & 0x80) && --retry);
 
 	return response;
 }
 
-DRESULT SD_SPI_Init(BYTE pdrv) {
-	uint8_t i, response;
-	uint8_t r7[4];
-	uint32_t retry;
+/* Receive a short data block (CSD, SCR, SD status) after its start token */
+static uint8_t SD_ReceiveDataBlock(SD_Card *card, uint8_t *buff, uint16_t len) {
+	uint32_t timeout = HAL_GetTick() + 200;
+	uint8_t token;
 
-	/* Reset status to STA_NOINIT at start of init to ensure fresh state
-	 * This allows re-initialization after card removal or errors */
-	Stat = STA_NOINIT;
+	do {
+		token = SD_ReceiveByte(card);
+	} while (token != 0xFE && HAL_GetTick() < timeout);
+	if (token != 0xFE)
+		return 1;
 
-	FCLK_SLOW();
+	for (uint16_t i = 0; i < len; i++)
+		buff[i] = SD_ReceiveByte(card);
+	SD_ReceiveByte(card);  // CRC
+	SD_ReceiveByte(card);
 
-	SD_CS_HIGH();
-	for (i = 0; i < 10; i++)
-		SD_TransmitByte(0xFF);
+	return 0;
+}
 
-	SD_CS_LOW();
-	response = SD_SendCommand(CMD0, 0, 0x95);
-	SD_CS_HIGH();
-	SD_TransmitByte(0xFF);
-	if (response != 0x01) {
-		SD_ResetSpiDma();
-		return RES_NOTRDY;
+static void SD_InitFinish(SD_Card *card, DRESULT res) {
+	if (res == RES_OK) {
+		card->clk = card->hw->clk_fast;
+		SD_Select(card);
+		if (SD_SendCommand(card, CMD10, 0, 0xFF) != 0x00 || SD_ReceiveDataBlock(card, card->cid, 16))
+			res = RES_NOTRDY;
+		SD_CS_HIGH(card->hw);
+		SD_TransmitByte(card, 0xFF);
 	}
+	card->init_res = res;
+	if (res == RES_OK)
+		card->stat &= ~STA_NOINIT; /* Clear STA_NOINIT flag */
+	card->init_state = res == RES_OK ? SD_INIT_READY : SD_INIT_FAILED;
+	if (card->init_done)
+		card->init_done(res);
+}
 
-	SD_CS_LOW();
-	response = SD_SendCommand(CMD8, 0x000001AA, 0x87);
-	for (i = 0; i < 4; i++)
-		r7[i] = SD_ReceiveByte();
-	SD_CS_HIGH();
-	SD_TransmitByte(0xFF);
+/* Start the card initialization, SD_InitPoll() advances it one step per call */
+void SD_InitStart(BYTE pdrv, SD_InitCallback done) {
+	SD_Card *card = SD_GetCard(pdrv);
 
-	sdhc = 0;
-	retry = HAL_GetTick() + 1000;
-	if (response == 0x01 && r7[2] == 0x01 && r7[3] == 0xAA) {
-		do {
-			SD_CS_LOW();
-			SD_SendCommand(CMD55, 0, 0xFF);
-			response = SD_SendCommand(ACMD41, 0x40000000, 0xFF);
-			SD_CS_HIGH();
-			SD_TransmitByte(0xFF);
-		} while (response != 0x00 && HAL_GetTick() < retry);
-
-		if (response != 0x00)
-			return RES_NOTRDY;
+	if (!card) {
+		if (done)
+			done(RES_PARERR);
+		return;
+	}
+
+	/* Set STA_NOINIT at start of init to ensure fresh state
+	 * This allows re-initialization after card removal or errors */
+	card->stat |= STA_NOINIT;
 
-		SD_CS_LOW();
-		response = SD_SendCommand(CMD58, 0, 0xFF);
+	card->init_done = done;
+	card->init_step = INIT_POWERUP;
+	card->init_state = SD_INIT_BUSY;
+}
+
+/* Run the next init step if it is due. Each call sends at most one command and
+ * returns without waiting, so it can be called from the main loop or a timer
+ * tick while other peripherals are being set up (not while the SPI is in use). */
+SD_InitState SD_InitPoll(BYTE pdrv) {
+	SD_Card *card = SD_GetCard(pdrv);
+	uint8_t i, response;
+	uint8_t r7[4];
+
+	if (!card)
+		return SD_INIT_FAILED;
+	if (card->init_state == SD_INIT_READY && (card->stat & STA_NOINIT))
+		card->init_state = SD_INIT_IDLE; /* Card lost since, needs a new init */
+	if (card->init_state != SD_INIT_BUSY)
+		return card->init_state;
+
+	switch (card->init_step) {
+	case INIT_POWERUP:
+		if (HAL_GetTick() < SD_POWERUP_MS)
+			break; /* Supply still settling */
+		SD_CardDetect(card);
+		if (card->stat & STA_NODISK) {
+			SD_InitFinish(card, RES_NOTRDY); /* Empty socket, nothing to clock */
+			break;
+		}
+		card->clk = SD_CLK_SLOW;
+		MODIFY_REG(card->hw->spi->Instance->CR1, SPI_BAUDRATEPRESCALER_256, card->clk);
+		SD_CS_HIGH(card->hw);
+		for (i = 0; i < 10; i++)
+			SD_TransmitByte(card, 0xFF);
+		card->init_step = INIT_CMD0;
+		break;
+
+	case INIT_CMD0:
+		SD_Select(card);
+		response = SD_SendCommand(card, CMD0, 0, 0x95);
+		SD_CS_HIGH(card->hw);
+		SD_TransmitByte(card, 0xFF);
+		if (response != 0x01) {
+			SD_ResetSpiDma(card);
+			SD_InitFinish(card, RES_NOTRDY);
+			break;
+		}
+		card->init_step = INIT_CMD8;
+		break;
+
+	case INIT_CMD8:
+		SD_Select(card);
+		response = SD_SendCommand(card, CMD8, 0x000001AA, 0x87);
+		for (i = 0; i < 4; i++)
+			r7[i] = SD_ReceiveByte(card);
+		SD_CS_HIGH(card->hw);
+		SD_TransmitByte(card, 0xFF);
+
+		card->sdhc = 0;
+		card->type = 0;
+		card->status_valid = 0;
+		card->erase_zero = -1;
+		card->erase_unit = 0;
+		card->n_trim = 0; /* The queued ranges belong to the card that was there before */
+		card->trim_busy = 0;
+		card->init_arg = (response == 0x01 && r7[2] == 0x01 && r7[3] == 0xAA) ? 0x40000000 : 0;
+		card->init_timeout = HAL_GetTick() + SD_INIT_TIMEOUT;
+		card->init_tick = HAL_GetTick() - 1;
+		card->init_step = INIT_ACMD41;
+		break;
+
+	case INIT_ACMD41:
+		if (HAL_GetTick() == card->init_tick)
+			break; /* One try per tick while the card powers up */
+		card->init_tick = HAL_GetTick();
+		SD_Select(card);
+		SD_SendCommand(card, CMD55, 0, 0xFF);
+		response = SD_SendCommand(card, ACMD41, card->init_arg, 0xFF);
+		SD_CS_HIGH(card->hw);
+		SD_TransmitByte(card, 0xFF);
+		if (response == 0x00) {
+			if (card->init_arg) {
+				card->init_step = INIT_CMD58;
+			} else {
+				card->type = CT_SD1;
+				SD_InitFinish(card, RES_OK);
+			}
+		} else if (card->init_tick >= card->init_timeout) {
+			SD_InitFinish(card, RES_NOTRDY);
+		}
+		break;
+
+	case INIT_CMD58:
+		SD_Select(card);
+		response = SD_SendCommand(card, CMD58, 0, 0xFF);
 		uint8_t ocr[4];
 		for (i = 0; i < 4; i++)
-			ocr[i] = SD_ReceiveByte();
-		SD_CS_HIGH();
+			ocr[i] = SD_ReceiveByte(card);
+		SD_CS_HIGH(card->hw);
 		if (ocr[0] & 0x40)
-			sdhc = 1;
-	} else {
-		do {
-			SD_CS_LOW();
-			SD_SendCommand(CMD55, 0, 0xFF);
-			response = SD_SendCommand(ACMD41, 0, 0xFF);
-			SD_CS_HIGH();
-			SD_TransmitByte(0xFF);
-		} while (response != 0x00 && HAL_GetTick() < retry);
-		if (response != 0x00)
-			return RES_NOTRDY;
+			card->sdhc = 1;
+		card->type = card->sdhc ? CT_SD2 | CT_BLOCK : CT_SD2;
+		SD_InitFinish(card, RES_OK);
+		break;
 	}
 
-	FCLK_FAST();
-
-	Stat &= ~STA_NOINIT; /* Clear STA_NOINIT flag */
-	return RES_OK;
+	return card->init_state;
 }
 
-DRESULT SD_WriteBlocks(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
-	if (!count)
-		return RES_ERROR;
-	if (Stat)
-		return RES_NOTRDY;
+DRESULT SD_SPI_Init(BYTE pdrv) {
+	SD_Card *card = SD_GetCard(pdrv);
 
-	if (!sdhc)
-		sector *= 512;
+	if (!card)
+		return RES_PARERR;
 
-	SD_CS_LOW();
+	/* Complete an init started by SD_InitStart() or run a new one */
+	if (card->init_state != SD_INIT_BUSY)
+		SD_InitStart(pdrv, NULL);
+	while (SD_InitPoll(pdrv) == SD_INIT_BUSY);
 
-	if (count == 1) {
-		// Single block write
-		if (SD_SendCommand(CMD24, sector, 0xFF) != 0x00) {
-			SD_CS_HIGH();
-			return RES_ERROR;
-		}
+	return card->init_res;
+}
 
-		SD_TransmitByte(0xFE);  // Start single block token
-		SD_TransmitBuffer(buff, 512);
-		SD_TransmitByte(0xFF);  // dummy CRC
-		SD_TransmitByte(0xFF);
+/* Get the card back in step after an interrupted transfer: clock out the rest
+ * of a data block, end a multi-block write or read, then ask for the status */
+static DRESULT SD_Resync(SD_Card *card) {
+	DRESULT res = RES_ERROR;
+	uint16_t i;
+
+	SD_CS_HIGH(card->hw);
+	SD_TransmitByte(card, 0xFF);
+	SD_Select(card);
+	for (i = 0; i < 512 + 2 + 1; i++)
+		SD_ReceiveByte(card); // A block cut short still takes its full length (rewritten by the retry)
+	SD_WaitReady(card, 500);
+	SD_TransmitByte(card, 0xFD);  // STOP_TRAN token, ignored outside a multi-block write
+	SD_ReceiveByte(card);
+	if (SD_WaitReady(card, 500) == RES_OK) {
+		SD_SendCommand(card, CMD12, 0, 0xFF);  // Ends a multi-block read
+		if (SD_SendCommand(card, CMD13, 0, 0xFF) == 0x00)
+			res = RES_OK;
+		SD_ReceiveByte(card);
+	}
+	SD_CS_HIGH(card->hw);
+	SD_TransmitByte(card, 0xFF);
 
-		uint8_t resp = SD_ReceiveByte();
-		if ((resp & 0x1F) != 0x05) {
-			SD_CS_HIGH();
-			return RES_ERROR;
-		}
+	return res;
+}
 
-		while (SD_ReceiveByte() == 0)
-			;  // busy wait
+/* Recover from a failed transfer, cheapest step first:
+ * 1. resync the bus with the card (not after an SPI/DMA fault)
+ * 2. restart SPI and DMA and resync, the card keeps its state
+ * 3. initialize the card again at the slow clock */
+static DRESULT SD_Recover(SD_Card *card) {
+	uint8_t fault = card->spi_fault;
+	uint8_t cid[16];
 
-	} else {
-		// Multiple blocks write
-		if (SD_SendCommand(CMD25, sector, 0xFF) != 0x00) {
-			SD_CS_HIGH();
-			return RES_ERROR;
-		}
+	card->spi_fault = 0;
+	card->stats.errors++;
 
-		while (count--) {
-			SD_TransmitByte(0xFC);  // Start multi-block write token
+	SD_CardDetect(card);
+	if (card->stat & STA_NODISK) {
+		card->stats.failed++;
+		return RES_NOTRDY;
+	}
 
-			SD_TransmitBuffer((uint8_t*) buff, 512);
-			SD_TransmitByte(0xFF);  // dummy CRC
-			SD_TransmitByte(0xFF);
+	if (!fault && SD_Resync(card) == RES_OK) {
+		card->stats.resync++;
+		return RES_OK;
+	}
 
-			uint8_t resp = SD_ReceiveByte();
-			if ((resp & 0x1F) != 0x05) {
-				SD_CS_HIGH();
-				return RES_ERROR;
-			}
+	SD_ResetSpiDma(card); // Back at the init clock, SD_Select() sets the card's own
+	if (SD_Resync(card) == RES_OK) {
+		card->stats.restart++;
+		return RES_OK;
+	}
 
-			while (SD_ReceiveByte() == 0)
-				;  // busy wait
-			buff += 512;
+	memcpy(cid, card->cid, 16);
+	if (SD_SPI_Init(card - sd_card) == RES_OK) {
+		if (memcmp(cid, card->cid, 16) == 0) {
+			card->stats.reinit++;
+			return RES_OK;
 		}
-
-		SD_TransmitByte(0xFD);  // STOP_TRAN token
-		while (SD_ReceiveByte() == 0)
-			;  // busy wait
+		card->stat |= STA_NOINIT; /* Another card: the volume has to be mounted again */
 	}
 
-	SD_CS_HIGH();
-	SD_TransmitByte(0xFF);
+	card->stats.failed++;
+	return RES_NOTRDY;
+}
 
-	return RES_OK;
+/* Take the sectors st..ed out of the queued freed ranges */
+static void SD_TrimClip(SD_Card *card, DWORD st, DWORD ed) {
+	uint8_t i = 0;
+
+	while (i < card->n_trim) {
+		if (ed < card->trim_st[i] || st > card->trim_ed[i]) {
+			i++; // No overlap
+		} else if (st > card->trim_st[i] && ed < card->trim_ed[i]) {
+			// Inside the range: split it, or keep the larger piece when the queue is full
+			if (card->n_trim < TRIM_QUEUE) {
+				card->trim_st[card->n_trim] = ed + 1;
+				card->trim_ed[card->n_trim++] = card->trim_ed[i];
+				card->trim_ed[i] = st - 1;
+			} else if (st - card->trim_st[i] >= card->trim_ed[i] - ed) {
+				card->trim_ed[i] = st - 1;
+			} else {
+				card->trim_st[i] = ed + 1;
+			}
+			i++;
+		} else if (st > card->trim_st[i]) {
+			card->trim_ed[i++] = st - 1;
+		} else if (ed < card->trim_ed[i]) {
+			card->trim_st[i++] = ed + 1;
+		} else {
+			card->n_trim--; // Whole range written, drop it
+			card->trim_st[i] = card->trim_st[card->n_trim];
+			card->trim_ed[i] = card->trim_ed[card->n_trim];
+		}
+	}
 }
 
-DRESULT SD_ReadBlocks(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
-	if (!count)
-		return RES_ERROR;
-	if (Stat)
-		return RES_NOTRDY;
+/* Sector transfers are run in steps (command, block start, block end, stop) so
+ * that SD_RunChunks() can keep the DMA of cards on different buses going at the
+ * same time: it starts a block on every card before it waits for the first. */
+static DRESULT SD_XferBegin(SD_Card *card, uint8_t write, LBA_t sector, UINT count) {
+	uint8_t cmd;
 
-	if (!sdhc)
+	if (!card->sdhc)
 		sector *= 512;
 
-	SD_CS_LOW();
+	SD_Select(card);
+
+	if (write)
+		cmd = count == 1 ? CMD24 : CMD25;
+	else
+		cmd = count == 1 ? CMD17 : CMD18;
+	if (SD_SendCommand(card, cmd, sector, 0xFF) != 0x00)
+		return RES_ERROR;
+
+	return RES_OK;
+}
 
-	if (count == 1) {
-		// Single block read
-		if (SD_SendCommand(CMD17, sector, 0xFF) != 0x00) {
-			SD_CS_HIGH();
+static DRESULT SD_BlockStart(SD_Card *card, uint8_t write, uint8_t multi, BYTE *buff) {
+	if (write) {
+		// Busy with the previous block: waited here and not after it, so that
+		// the other cards get their block meanwhile and program at the same time
+		if (multi && SD_WaitReady(card, 500) != RES_OK)
 			return RES_ERROR;
-		}
 
+		SD_TransmitByte(card, multi ? 0xFC : 0xFE);  // Start block token
+		if (SD_StartBuffer(card, buff, NULL, 512))
+			return RES_ERROR;
+	} else {
 		uint8_t token;
 		uint32_t timeout = HAL_GetTick() + 200;
 		do {
-			token = SD_ReceiveByte();
+			token = SD_ReceiveByte(card);
 			if (token == 0xFE)
 				break;
 		} while (HAL_GetTick() < timeout);
 
-		if (token != 0xFE) {
-			SD_CS_HIGH();
+		if (token != 0xFE)
 			return RES_ERROR;
-		}
 
-		SD_ReceiveBuffer(buff, 512);
-		SD_ReceiveByte();  // CRC
-		SD_ReceiveByte();
+		if (SD_StartBuffer(card, NULL, buff, 512))
+			return RES_ERROR;
+	}
+
+	return RES_OK;
+}
 
-	} else {
-		// Multiple blocks read
-		if (SD_SendCommand(CMD18, sector, 0xFF) != 0x00) {
-			SD_CS_HIGH();
+static DRESULT SD_BlockEnd(SD_Card *card, uint8_t write) {
+	if (SD_WaitBuffer(card))
+		return RES_ERROR;
+
+	if (write) {
+		SD_TransmitByte(card, 0xFF);  // dummy CRC
+		SD_TransmitByte(card, 0xFF);
+
+		uint8_t resp = SD_ReceiveByte(card);
+		if ((resp & 0x1F) != 0x05)
 			return RES_ERROR;
+	} else {
+		SD_ReceiveByte(card);  // discard CRC
+		SD_ReceiveByte(card);
+	}
+
+	return RES_OK;
+}
+
+static DRESULT SD_XferEnd(SD_Card *card, uint8_t write, uint8_t multi) {
+	if (multi) {
+		if (write) {
+			if (SD_WaitReady(card, 500) != RES_OK) {  // Last block programmed
+				SD_CS_HIGH(card->hw);
+				return RES_ERROR;
+			}
+			SD_TransmitByte(card, 0xFD);  // STOP_TRAN token
+			SD_ReceiveByte(card);       // Nbr byte, the card goes busy after it (waited lazily)
+		} else {
+			SD_SendCommand(card, CMD12, 0, 0xFF);  // STOP_TRANSMISSION
 		}
+	}
+	// A single block or the end of a multi-block write is programmed in the
+	// background: SD_SendCommand(card) and CTRL_SYNC wait for it before the next access
 
-		while (count--) {
-			uint8_t token;
-			uint32_t timeout = HAL_GetTick() + 200;
+	SD_CS_HIGH(card->hw);
+	SD_TransmitByte(card, 0xFF);  // Extra 8 clocks
 
-			do {
-				token = SD_ReceiveByte();
-				if (token == 0xFE)
-					break;
-			} while (HAL_GetTick() < timeout);
+	return RES_OK;
+}
 
-			if (token != 0xFE) {
-				SD_CS_HIGH();
-				return RES_ERROR;
+/* Move the chunks of n cards block by block, the cards take turns at starting a
+ * block and the DMA transfers run side by side. The cards must be on different
+ * buses. Returns a bit per failed chunk. */
+static uint32_t SD_RunChunks(SD_Card **card, const SD_Chunk *chunk, UINT n, uint8_t write) {
+	BYTE *buff[SD_CARDS];
+	UINT left[SD_CARDS], run[SD_CARDS];
+	uint32_t active = 0, failed = 0;
+	UINT i;
+
+	for (i = 0; i < n; i++) {
+		buff[i] = chunk[i].buff;
+		left[i] = chunk[i].count;
+		run[i] = chunk[i].first;
+		if (SD_XferBegin(card[i], write, chunk[i].sector, chunk[i].count) == RES_OK)
+			active |= 1UL << i;
+		else
+			failed |= 1UL << i;
+	}
+
+	while (active) {
+		for (i = 0; i < n; i++) {
+			if ((active & 1UL << i)
+					&& SD_BlockStart(card[i], write, chunk[i].count > 1, buff[i]) != RES_OK) {
+				active &= ~(1UL << i);
+				failed |= 1UL << i;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			if (!(active & 1UL << i))
+				continue;
+			if (SD_BlockEnd(card[i], write) != RES_OK) {
+				active &= ~(1UL << i);
+				failed |= 1UL << i;
+				continue;
+			}
+			buff[i] += 512;
+			if (--run[i] == 0) { // Skip the other cards' share of the buffer
+				buff[i] += chunk[i].gap * 512;
+				run[i] = chunk[i].run;
 			}
+			if (--left[i] == 0)
+				active &= ~(1UL << i);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (failed & 1UL << i)
+			SD_CS_HIGH(card[i]->hw);
+		else if (SD_XferEnd(card[i], write, chunk[i].count > 1) != RES_OK)
+			failed |= 1UL << i;
+	}
+
+	return failed;
+}
+
+static DRESULT SD_WriteSectors(SD_Card *card, const BYTE *buff, LBA_t sector, UINT count) {
+	SD_Chunk chunk = { 0, (BYTE*) buff, sector, count, count, count, 0 };
+
+	return SD_RunChunks(&card, &chunk, 1, 1) ? RES_ERROR : RES_OK;
+}
+
+static DRESULT SD_ReadSectors(SD_Card *card, BYTE *buff, LBA_t sector, UINT count) {
+	SD_Chunk chunk = { 0, buff, sector, count, count, count, 0 };
+
+	return SD_RunChunks(&card, &chunk, 1, 0) ? RES_ERROR : RES_OK;
+}
+
+DRESULT SD_WriteBlocks(BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count) {
+	SD_Card *card = SD_GetCard(pdrv);
+	DRESULT res;
+
+	if (!card)
+		return RES_PARERR;
+	if (!count)
+		return RES_ERROR;
+	SD_CardDetect(card);
+	if (card->stat)
+		return RES_NOTRDY;
+
+	SD_TrimClip(card, sector, sector + count - 1); // Never erase the blocks after they are written again
 
-			SD_ReceiveBuffer(buff, 512);
-			SD_ReceiveByte();  // discard CRC
-			SD_ReceiveByte();
+	res = SD_WriteSectors(card, buff, sector, count);
+	if (res != RES_OK && SD_Recover(card) == RES_OK)
+		res = SD_WriteSectors(card, buff, sector, count); // One more try once the link is back
+	return res;
+}
+
+DRESULT SD_ReadBlocks(BYTE pdrv, BYTE *buff, LBA_t sector, UINT count) {
+	SD_Card *card = SD_GetCard(pdrv);
+	DRESULT res;
+
+	if (!card)
+		return RES_PARERR;
+	if (!count)
+		return RES_ERROR;
+	SD_CardDetect(card);
+	if (card->stat)
+		return RES_NOTRDY;
+
+	res = SD_ReadSectors(card, buff, sector, count);
+	if (res != RES_OK && SD_Recover(card) == RES_OK)
+		res = SD_ReadSectors(card, buff, sector, count);
+	return res;
+}
 
-			buff += 512;
+/* Run one chunk per card, side by side when the cards are on different buses.
+ * A chunk that fails is retried once on its own once the link is back. */
+static DRESULT SD_Parallel(const SD_Chunk *chunk, UINT n, uint8_t write) {
+	SD_Card *card[SD_CARDS];
+	SD_Chunk part[SD_CARDS];
+	uint8_t shared = 0;
+	uint32_t failed = 0;
+	DRESULT res = RES_OK;
+	UINT i, j, m = 0;
+
+	if (n > SD_CARDS)
+		return RES_PARERR;
+	for (i = 0; i < n; i++) {
+		if (!chunk[i].count)
+			continue; // Nothing for this card
+		card[m] = SD_GetCard(chunk[i].pdrv);
+		if (!card[m])
+			return RES_PARERR;
+		for (j = 0; j < m; j++) {
+			if (card[j] == card[m])
+				return RES_PARERR; // One chunk per card
+			if (card[j]->hw->spi == card[m]->hw->spi)
+				shared = 1;
 		}
+		SD_CardDetect(card[m]);
+		if (card[m]->stat)
+			return RES_NOTRDY;
+		part[m++] = chunk[i];
+	}
 
-		SD_SendCommand(CMD12, 0, 0xFF);  // STOP_TRANSMISSION
+	if (write) {
+		for (i = 0; i < m; i++)
+			SD_TrimClip(card[i], part[i].sector, part[i].sector + part[i].count - 1);
 	}
 
-	SD_CS_HIGH();
-	SD_TransmitByte(0xFF);  // Extra 8 clocks
+	if (shared) { // One bus, one card at a time
+		for (i = 0; i < m; i++) {
+			if (SD_RunChunks(&card[i], &part[i], 1, write))
+				failed |= 1UL << i;
+		}
+	} else {
+		failed = SD_RunChunks(card, part, m, write);
+	}
 
-	return RES_OK;
+	for (i = 0; i < m; i++) {
+		if ((failed & 1UL << i)
+				&& (SD_Recover(card[i]) != RES_OK || SD_RunChunks(&card[i], &part[i], 1, write)))
+			res = RES_ERROR;
+	}
+
+	return res;
+}
+
+DRESULT SD_ReadParallel(const SD_Chunk *chunk, UINT n) {
+	return SD_Parallel(chunk, n, 0);
+}
+
+DRESULT SD_WriteParallel(const SD_Chunk *chunk, UINT n) {
+	return SD_Parallel(chunk, n, 1);
 }
 
-static DRESULT SD_GetSectorCount(void *buff) {
+static DRESULT SD_GetSectorCount(SD_Card *card, void *buff) {
 	BYTE n, csd[16];
 	DWORD csize;
 
-	if ((SD_SendCommand(CMD9, 0, 0xFF) != 0) || !SD_ReceiveBuffer(csd, 16)) {
+	if ((SD_SendCommand(card, CMD9, 0, 0xFF) != 0) || SD_ReceiveDataBlock(card, csd, 16)) {
 		return RES_ERROR;
 	}
 
 	if ((csd[0] >> 6) == 1) { /* SDC ver 2.00 */
 		csize = csd[9] + ((WORD) csd[8] << 8) + ((DWORD) (csd[7] & 63) << 16)
 				+ 1;
-		*(DWORD*) buff = csize << 10;
+		*(LBA_t*) buff = (LBA_t) csize << 10;
 	} else { /* SDC ver 1.XX or MMC ver 3 */
 		n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
 		csize = (csd[8] >> 6) + ((WORD) csd[7] << 2)
 				+ ((WORD) (csd[6] & 3) << 10) + 1;
-		*(DWORD*) buff = csize << (n - 9);
+		*(LBA_t*) buff = (LBA_t) csize << (n - 9);
 	}
 
 	return RES_OK;
 }
 
-static DRESULT SD_GetBlockSize(void *buff) {
-	BYTE n, csd[16];
+/* Read the 64-byte SD status (ACMD13) */
+static DRESULT SD_ReadStatus(SD_Card *card, uint8_t *sdstat) {
+	if (!(card->type & CT_SDC))
+		return RES_ERROR;
 
-	if (CardType & CT_SD2) { /* SDC ver 2.00 */
-		if (SD_SendCommand(ACMD13, 0, 0xFF) != 0) {
-			return RES_ERROR;
-		}
+	if (SD_SendCommand(card, ACMD13, 0, 0xFF) != 0)
+		return RES_ERROR;
+	SD_ReceiveByte(card); // 2nd byte of R2
+
+	return SD_ReceiveDataBlock(card, sdstat, 64) ? RES_ERROR : RES_OK;
+}
 
-		SD_TransmitByte(0xFF);
-		if (!SD_ReceiveBuffer(csd, 16)) {
+static DRESULT SD_GetStatus(SD_Card *card, SD_Status *st) {
+	static const uint8_t speed_class[5] = { 0, 2, 4, 6, 10 };
+	static const uint32_t au_large[5] = { 24576, 32768, 49152, 65536, 131072 }; /* 12, 16, 24, 32 and 64 MB */
+	uint8_t sdstat[64], n;
+
+	if (!card->status_valid) {
+		if (SD_ReadStatus(card, sdstat) != RES_OK)
 			return RES_ERROR;
-		}
 
-		for (n = 64 - 16; n; n--) {
-			SD_TransmitByte(0xFF); /* Purge trailing data */
+		n = sdstat[8]; // SPEED_CLASS
+		card->status.speed_class = n < 5 ? speed_class[n] : 0;
+		card->status.uhs_grade = sdstat[14] >> 4;
+		card->status.video_class = sdstat[15];
+		n = sdstat[10] >> 4; // AU_SIZE: 16 KB << (n - 1) up to 8 MB, then 12 MB to 64 MB
+		card->status.au_sectors = n == 0 ? 0 : n <= 10 ? 32UL << (n - 1) : au_large[n - 11];
+		card->status.erase_size = ((uint16_t) sdstat[11] << 8) | sdstat[12];
+		card->status.erase_timeout = sdstat[13] >> 2;
+		card->status.erase_offset = sdstat[13] & 3;
+		card->status_valid = 1;
+	}
+
+	*st = card->status;
+	return RES_OK;
+}
+
+static DRESULT SD_GetBlockSize(SD_Card *card, void *buff) {
+	SD_Status st;
+	BYTE csd[16];
+
+	if (card->type & CT_SD2) { /* SDC ver 2.00: the allocation unit */
+		if (SD_GetStatus(card, &st) != RES_OK) {
+			return RES_ERROR;
 		}
-		*(DWORD*) buff = 16UL << (csd[10] >> 4);
+		*(DWORD*) buff = st.au_sectors ? st.au_sectors : 1;
 
 	} else { /* SDC ver 1.XX or MMC */
-		if ((SD_SendCommand(CMD9, 0, 0xFF) != 0)
-				|| !SD_ReceiveBuffer(csd, 16)) {
+		if ((SD_SendCommand(card, CMD9, 0, 0xFF) != 0)
+				|| SD_ReceiveDataBlock(card, csd, 16)) {
 			return RES_ERROR;
 		}
 
-		if (CardType & CT_SD1) { /* SDC ver 1.XX */
+		if (card->type & CT_SD1) { /* SDC ver 1.XX */
 			*(DWORD*) buff = (((csd[10] & 63) << 1)
 					+ ((WORD) (csd[11] & 128) >> 7) + 1)
 					<< ((csd[13] >> 6) - 1);
@@ -484,62 +988,215 @@ static DRESULT SD_GetBlockSize(void *buff) {
 	return RES_OK;
 }
 
-static DRESULT SD_TrimSectors(BYTE drv, void *buff) {
-	BYTE csd[16];
-	DWORD *dp, st, ed;
+static DWORD SD_GetEraseUnit(SD_Card *card) {
+	BYTE n, csd[16];
+
+	if (SD_SendCommand(card, CMD9, 0, 0xFF) != 0 || SD_ReceiveDataBlock(card, csd, 16))
+		return 1;
+
+	/* SECTOR_SIZE is in write blocks, WRITE_BL_LEN is 9 (512 bytes) on all but some SDSC cards */
+	n = ((csd[12] & 3) << 2) + (csd[13] >> 6);
+	return ((((csd[10] & 63) << 1) + ((csd[11] & 128) >> 7) + 1)) << (n > 9 ? n - 9 : 0);
+}
+
+/* Queue the freed sectors for erasing in idle time, merged with adjacent ranges */
+static DRESULT SD_TrimSectors(SD_Card *card, void *buff) {
+	LBA_t *dp = buff;
+	DWORD st, ed;
+	uint8_t i, s;
 
-	if (!(CardType & CT_SDC)) {
-		return RES_ERROR; /* Check if the card is SDC */
+	if (dp[1] < dp[0])
+		return RES_PARERR;
+	st = (DWORD) dp[0];
+	ed = (DWORD) dp[1];
+
+	i = 0;
+	while (i < card->n_trim) {
+		if (st <= card->trim_ed[i] + 1 && ed + 1 >= card->trim_st[i]) {
+			if (card->trim_st[i] < st)
+				st = card->trim_st[i];
+			if (card->trim_ed[i] > ed)
+				ed = card->trim_ed[i];
+			card->n_trim--; // Absorbed, look again for ranges the union now touches
+			card->trim_st[i] = card->trim_st[card->n_trim];
+			card->trim_ed[i] = card->trim_ed[card->n_trim];
+		} else {
+			i++;
+		}
 	}
 
-	if (SD_ioctl(drv, MMC_GET_CSD, csd)) {
-		return RES_ERROR; /* Get CSD */
+	if (card->n_trim == TRIM_QUEUE) {
+		// Queue full: TRIM is only a hint, keep the larger ranges
+		for (s = 0, i = 1; i < card->n_trim; i++) {
+			if (card->trim_ed[i] - card->trim_st[i] < card->trim_ed[s] - card->trim_st[s])
+				s = i;
+		}
+		if (card->trim_ed[s] - card->trim_st[s] >= ed - st)
+			return RES_OK;
+		card->n_trim--;
+		card->trim_st[s] = card->trim_st[card->n_trim];
+		card->trim_ed[s] = card->trim_ed[card->n_trim];
 	}
 
-	if (!(csd[0] >> 6) && !(csd[10] & 0x40)) {
-		return RES_ERROR; /* Check if sector erase can be applied */
+	card->trim_st[card->n_trim] = st;
+	card->trim_ed[card->n_trim++] = ed;
+	return RES_OK;
+}
+
+/* Erase queued ranges in whole erase units until the time budget (ms) runs out */
+static DRESULT SD_TrimIdle(SD_Card *card, void *buff) {
+	uint32_t budget = *(DWORD*) buff;
+	uint32_t start = HAL_GetTick();
+	DWORD st, ed;
+
+	while (SD_ReceiveByte(card) != 0xFF) {
+		if (HAL_GetTick() - start >= budget)
+			return RES_OK; // Still busy with the previous erase
 	}
+	card->trim_busy = 0;
+
+	if (card->n_trim && !card->erase_unit)
+		card->erase_unit = SD_GetEraseUnit(card);
+
+	while (card->n_trim && HAL_GetTick() - start < budget) {
+		st = (card->trim_st[0] + card->erase_unit - 1) / card->erase_unit * card->erase_unit;
+		ed = (card->trim_ed[0] + 1) / card->erase_unit * card->erase_unit;
+		if (ed > st + TRIM_MAX_SECTORS)
+			ed = st + (TRIM_MAX_SECTORS > card->erase_unit ? TRIM_MAX_SECTORS / card->erase_unit * card->erase_unit : card->erase_unit);
+
+		if (st >= ed || ed > card->trim_ed[0]) {
+			card->n_trim--; // Done with this range, partial units at its ends are left alone
+			card->trim_st[0] = card->trim_st[card->n_trim];
+			card->trim_ed[0] = card->trim_ed[card->n_trim];
+		} else {
+			card->trim_st[0] = ed;
+		}
+		if (st >= ed)
+			continue;
 
-	dp = buff;
-	st = dp[0];
-	ed = dp[1];
+		ed--;
+		if (!card->sdhc) {
+			st *= 512;
+			ed *= 512;
+		}
+		if (SD_SendCommand(card, CMD32, st, 0xFF) != 0
+				|| SD_SendCommand(card, CMD33, ed, 0xFF) != 0
+				|| SD_SendCommand(card, CMD38, 0, 0xFF) != 0) {
+			return RES_ERROR;
+		}
 
-	if (!(CardType & CT_BLOCK)) {
-		st *= 512;
-		ed *= 512;
+		card->trim_busy = 1;
+		while (SD_ReceiveByte(card) != 0xFF) {
+			if (HAL_GetTick() - start >= budget)
+				return RES_OK; // Let it finish in the background
+		}
+		card->trim_busy = 0;
 	}
 
-	if (SD_SendCommand(CMD32, st, 0xFF) == 0
-			&& SD_SendCommand(CMD33, ed, 0xFF) == 0
-			&& SD_SendCommand(CMD38, 0, 0xFF) == 0 && SD_WaitReady(30000)) {
+	return RES_OK;
+}
+
+static int8_t SD_EraseReadsZero(SD_Card *card) {
+	uint8_t scr[8];
+
+	if (!card->sdhc)
+		return 0; /* Byte addressed cards may erase in larger units, write zeros instead */
+
+	SD_SendCommand(card, CMD55, 0, 0xFF);
+	if (SD_SendCommand(card, CMD51, 0, 0xFF) != 0x00 || SD_ReceiveDataBlock(card, scr, 8))
+		return 0;
+
+	return (scr[1] & 0x80) ? 0 : 1; /* DATA_STAT_AFTER_ERASE (SCR bit 55) */
+}
+
+static DRESULT SD_ZeroSectors(SD_Card *card, void *buff) {
+	LBA_t *dp = buff;
+	DWORD st, ed, count;
+	DRESULT res = RES_OK;
+
+	if (dp[1] < dp[0])
+		return RES_PARERR;
+	st = (DWORD) dp[0];
+	ed = (DWORD) dp[1];
+	count = ed - st + 1;
+
+	SD_TrimClip(card, st, ed);
+
+	if (card->erase_zero < 0)
+		card->erase_zero = SD_EraseReadsZero(card);
+
+	// Erase when the card reads erased blocks back as zeros
+	if (card->erase_zero && SD_SendCommand(card, CMD32, st, 0xFF) == 0
+			&& SD_SendCommand(card, CMD33, ed, 0xFF) == 0
+			&& SD_SendCommand(card, CMD38, 0, 0xFF) == 0
+			&& SD_WaitReady(card, 30000) == RES_OK) {
 		return RES_OK;
 	}
 
-	return RES_ERROR;
+	// Otherwise write the blocks from the fixed zero source in a CMD25 burst
+	if (!card->sdhc)
+		st *= 512;
+
+	if (SD_SendCommand(card, CMD25, st, 0xFF) != 0x00)
+		return RES_ERROR;
+
+	while (res == RES_OK && count--) {
+		SD_TransmitByte(card, 0xFC);  // Start multi-block write token
+
+		if (SD_TransmitZeros(card, 512)) {
+			res = RES_ERROR;
+			break;
+		}
+		SD_TransmitByte(card, 0xFF);  // dummy CRC
+		SD_TransmitByte(card, 0xFF);
+
+		uint8_t resp = SD_ReceiveByte(card);
+		if ((resp & 0x1F) != 0x05) {
+			res = RES_ERROR;
+			break;
+		}
+
+		res = SD_WaitReady(card, 500);  // Block programmed
+	}
+
+	// The burst is ended on every path, or the card takes the next command as data
+	SD_WaitReady(card, 500);
+	SD_TransmitByte(card, 0xFD);  // STOP_TRAN token
+	SD_ReceiveByte(card);       // Nbr byte, the card goes busy after it (waited lazily)
+
+	return res;
 }
 
 DRESULT SD_ioctl(BYTE drv, BYTE cmd, void *buff) {
+	SD_Card *card = SD_GetCard(drv);
 	DRESULT res = RES_ERROR;
 
-	if (drv)
+	if (!card)
 		return RES_PARERR;
 
-	if (Stat & STA_NOINIT)
+	if (cmd == SD_GET_STATS) { // Also readable while the card is down
+		*(SD_Stats*) buff = card->stats;
+		return RES_OK;
+	}
+
+	if (card->stat & STA_NOINIT)
 		return RES_NOTRDY;
 
-	SD_CS_LOW();
+	SD_Select(card);
 
 	switch (cmd) {
 	case CTRL_SYNC:
-		res = RES_OK;
+		res = SD_WaitReady(card, card->trim_busy ? 30000 : 500); // Finish the pending write programming or idle time erase
+		if (res == RES_OK)
+			card->trim_busy = 0;
 		break;
 
 	case GET_SECTOR_COUNT:
-		res = SD_GetSectorCount(buff);
+		res = SD_GetSectorCount(card, buff);
 		break;
 
 	case GET_BLOCK_SIZE:
-		res = SD_GetBlockSize(buff);
+		res = SD_GetBlockSize(card, buff);
 		break;
 
 	case GET_SECTOR_SIZE:
@@ -548,47 +1205,52 @@ DRESULT SD_ioctl(BYTE drv, BYTE cmd, void *buff) {
 		break;
 
 	case CTRL_TRIM:
-		res = SD_TrimSectors(drv, buff);
+		res = SD_TrimSectors(card, buff);
 		break;
 
-	default:
-		res = RES_PARERR;
+	case CTRL_IDLE:
+		res = SD_TrimIdle(card, buff);
 		break;
-	}
 
-	SD_CS_HIGH();
+	case MMC_GET_TYPE:
+		*(BYTE*) buff = card->type;
+		res = RES_OK;
+		break;
 
-	return res;
-}
+	case MMC_GET_SDSTAT:
+		res = SD_ReadStatus(card, buff);
+		break;
 
-inline DSTATUS SD_status(BYTE drv) {
-	uint8_t r1;
-	DSTATUS res = RES_NOTRDY;
+	case SD_GET_STATUS:
+		res = SD_GetStatus(card, buff);
+		break;
 
-	if (drv)
-		return RES_NOTRDY;
+	case CTRL_ZERO:
+		res = SD_ZeroSectors(card, buff);
+		break;
 
-	if (Stat & STA_NOINIT)
-		return RES_NOTRDY;
+	default:
+		res = RES_PARERR;
+		break;
+	}
 
-	SD_CS_LOW();
-	while (SD_ReceiveByte() != 0xFF);
+	SD_CS_HIGH(card->hw);
+	SD_TransmitByte(card, 0xFF); // Release DO for the other cards on the bus
 
-	r1 = SD_SendCommand(CMD13, 0, 0x01);
+	if (card->spi_fault) // The DMA of the zero burst failed: restart the link here, not in the next transfer
+		SD_Recover(card);
 
-	if (r1 != 0xFF) {
-		SD_ReceiveByte();
-		if (r1 == 0x00)
-			res = RES_OK;
-	}
+	return res;
+}
 
-	SD_CS_HIGH();
-	SD_ReceiveByte();
+inline DSTATUS SD_status(BYTE drv) {
+	SD_Card *card = SD_GetCard(drv);
 
-	if (res != RES_OK)
-		Stat |= STA_NOINIT;
-	else
-		Stat &= ~STA_NOINIT;
+	if (!card)
+		return STA_NOINIT;
 
-	return res;
+	/* Answered from the cached state, the card itself is checked when a transfer
+	 * fails (SD_Recover) and a removal is seen through the card-detect switch */
+	SD_CardDetect(card);
+	return card->stat;
 }
@@ -0,0 +1,186 @@
+/******************************************************************************
+ *  File        : sd_stripe.c (two or more SD cards as one volume, RAID-0)
+ *  Author      : ControllersTech
+ *  Website     : https://controllerstech.com
+ *  Date        : June 26, 2025
+ *
+ *  Description :
+ *    This file is part of a custom STM32/Embedded tutorial series.
+ *    For documentation, updates, and more examples, visit the website above.
+ *
+ *  Note :
+ *    This code is written and maintained by ControllersTech.
+ *    You are free to use and modify it for learning and development.
+ ******************************************************************************/
+
+#include "sd_stripe.h"
+#include "sd_spi.h"
+
+/***************************************************************
+ * 🔧 USER-MODIFIABLE SECTION
+ * You are free to edit anything below this line
+ ***************************************************************/
+
+/* Sectors per stripe. Every card still gets one multi-block command per request
+ * whatever the stripe size, so small stripes cost nothing and let even a
+ * two-sector request use all cards. */
+#define STRIPE_SECTORS 1
+
+/* Member cards (sd_spi.c drive numbers), on different SPI buses to run in
+ * parallel. They are not drives of their own while the stripe is in use
+ * (SD_USE_STRIPE). */
+static const BYTE stripe_drv[] = { 0, 1 };
+
+/***************************************************************
+ * 🚫 DO NOT MODIFY BELOW THIS LINE
+ * Auto-generated/system-managed code. Changes may be lost.
+ ***************************************************************/
+#define STRIPE_CARDS (sizeof(stripe_drv) / sizeof(stripe_drv[0]))
+
+/* Sector on its card of a volume sector */
+static LBA_t SD_StripeMap(LBA_t sector) {
+	return sector / STRIPE_SECTORS / STRIPE_CARDS * STRIPE_SECTORS + sector % STRIPE_SECTORS;
+}
+
+/* First volume sector from sector on that is on member m */
+static LBA_t SD_StripeFirst(LBA_t sector, UINT m) {
+	LBA_t stripe = sector / STRIPE_SECTORS;
+	UINT on = stripe % STRIPE_CARDS;
+
+	if (on == m)
+		return sector;
+	return (stripe + (m + STRIPE_CARDS - on) % STRIPE_CARDS) * STRIPE_SECTORS;
+}
+
+/* Sectors st..ed of the volume on member m, as sectors *cst..*ced of the card.
+ * Returns 0 if the range has none on that card. */
+static uint8_t SD_StripeRange(LBA_t st, LBA_t ed, UINT m, LBA_t *cst, LBA_t *ced) {
+	LBA_t end = SD_StripeMap(SD_StripeFirst(ed + 1, m));
+
+	*cst = SD_StripeMap(SD_StripeFirst(st, m));
+	if (end == *cst)
+		return 0;
+	*ced = end - 1;
+	return 1;
+}
+
+static DRESULT SD_StripeXfer(BYTE *buff, LBA_t sector, UINT count, uint8_t write) {
+	SD_Chunk chunk[STRIPE_CARDS];
+	LBA_t lo;
+
+	if (!count)
+		return RES_PARERR;
+
+	for (UINT m = 0; m < STRIPE_CARDS; m++) {
+		lo = SD_StripeFirst(sector, m);
+		chunk[m].pdrv = stripe_drv[m];
+		chunk[m].sector = SD_StripeMap(lo);
+		chunk[m].count = SD_StripeMap(SD_StripeFirst(sector + count, m)) - chunk[m].sector;
+		chunk[m].buff = chunk[m].count ? buff + (lo - sector) * 512 : buff;
+		chunk[m].first = STRIPE_SECTORS - lo % STRIPE_SECTORS;
+		chunk[m].run = STRIPE_SECTORS;
+		chunk[m].gap = (STRIPE_CARDS - 1) * STRIPE_SECTORS;
+	}
+
+	return write ? SD_WriteParallel(chunk, STRIPE_CARDS) : SD_ReadParallel(chunk, STRIPE_CARDS);
+}
+
+DSTATUS SD_StripeInit(void) {
+	for (UINT m = 0; m < STRIPE_CARDS; m++) {
+		if (SD_status(stripe_drv[m]) & STA_NOINIT)
+			SD_SPI_Init(stripe_drv[m]);
+	}
+	return SD_StripeStatus();
+}
+
+/* The volume is usable only with all cards up */
+DSTATUS SD_StripeStatus(void) {
+	DSTATUS stat = 0;
+
+	for (UINT m = 0; m < STRIPE_CARDS; m++)
+		stat |= SD_status(stripe_drv[m]);
+	return stat;
+}
+
+DRESULT SD_StripeRead(BYTE *buff, LBA_t sector, UINT count) {
+	return SD_StripeXfer(buff, sector, count, 0);
+}
+
+DRESULT SD_StripeWrite(const BYTE *buff, LBA_t sector, UINT count) {
+	return SD_StripeXfer((BYTE*) buff, sector, count, 1);
+}
+
+/* A request over whole stripes of all cards keeps them all busy. A burst up to
+ * the erase unit, an AU on every card, is one in-AU burst on each of them. */
+DRESULT SD_StripeCaps(BlockCaps *caps) {
+	DRESULT res = SD_StripeIoctl(GET_BLOCK_SIZE, &caps->erase_unit);
+
+	caps->align = STRIPE_SECTORS * STRIPE_CARDS;
+	caps->max_burst = res == RES_OK ? caps->erase_unit : 0;
+	return res;
+}
+
+DRESULT SD_StripeIoctl(BYTE cmd, void *buff) {
+	DRESULT res = RES_OK;
+	LBA_t n, size = 0;
+	DWORD blk, au = 0;
+	LBA_t *dp, range[2];
+	uint32_t start, spent;
+
+	switch (cmd) {
+	case CTRL_SYNC:
+		for (UINT m = 0; m < STRIPE_CARDS && res == RES_OK; m++)
+			res = SD_ioctl(stripe_drv[m], CTRL_SYNC, NULL);
+		break;
+
+	case GET_SECTOR_COUNT: // Whole stripes of the smallest card
+		for (UINT m = 0; m < STRIPE_CARDS && res == RES_OK; m++) {
+			res = SD_ioctl(stripe_drv[m], GET_SECTOR_COUNT, &n);
+			if (m == 0 || n < size)
+				size = n;
+		}
+		*(LBA_t*) buff = size / STRIPE_SECTORS * STRIPE_SECTORS * STRIPE_CARDS;
+		break;
+
+	case GET_SECTOR_SIZE:
+		*(WORD*) buff = 512;
+		break;
+
+	case GET_BLOCK_SIZE: // An erase block on every card
+		for (UINT m = 0; m < STRIPE_CARDS && res == RES_OK; m++) {
+			res = SD_ioctl(stripe_drv[m], GET_BLOCK_SIZE, &blk);
+			if (blk > au)
+				au = blk;
+		}
+		*(DWORD*) buff = au * STRIPE_CARDS;
+		break;
+
+	case CTRL_TRIM:
+	case CTRL_ZERO: // Each card gets its own part of the range
+		dp = buff;
+		if (dp[1] < dp[0])
+			return RES_PARERR;
+		for (UINT m = 0; m < STRIPE_CARDS && res == RES_OK; m++) {
+			if (SD_StripeRange(dp[0], dp[1], m, &range[0], &range[1]))
+				res = SD_ioctl(stripe_drv[m], cmd, range);
+		}
+		break;
+
+	case CTRL_IDLE: // The cards share the time
+		start = HAL_GetTick();
+		for (UINT m = 0; m < STRIPE_CARDS && res == RES_OK; m++) {
+			spent = HAL_GetTick() - start;
+			if (spent >= *(DWORD*) buff)
+				break;
+			blk = *(DWORD*) buff - spent;
+			res = SD_ioctl(stripe_drv[m], CTRL_IDLE, &blk);
+		}
+		break;
+
+	default:
+		res = RES_PARERR;
+		break;
+	}
+
+	return res;
+}
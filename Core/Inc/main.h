@@ -57,11 +57,20 @@ void Error_Handler(void);
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
+#define SD_CD_Pin GPIO_PIN_0
+#define SD_CD_GPIO_Port GPIOB
+#define SD_CD_EXTI_IRQn EXTI0_IRQn
+#define SD2_CS_Pin GPIO_PIN_1
+#define SD2_CS_GPIO_Port GPIOB
 #define SD_CS_Pin GPIO_PIN_12
 #define SD_CS_GPIO_Port GPIOB
+#define SD2_CD_Pin GPIO_PIN_4
+#define SD2_CD_GPIO_Port GPIOB
+#define SD2_CD_EXTI_IRQn EXTI4_IRQn
 
 /* USER CODE BEGIN Private defines */
 #define SD_SPI_HANDLE hspi1
+#define SD2_SPI_HANDLE hspi2
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
@@ -31,6 +31,7 @@
 #include "stdio.h"
 #include "sd_benchmark.h"
 #include "fatfs.h"
+#include "sd_spi.h"
 
 /* USER CODE END Includes */
 
@@ -116,11 +117,14 @@ int main(void)
   MX_GPIO_Init();
   MX_DMA_Init();
   MX_SPI1_Init();
+  MX_SPI2_Init();
   /* USER CODE BEGIN 2 */
 
   //HAL some times making pin low after init
   HAL_GPIO_WritePin(SD_CS_GPIO_Port, SD_CS_Pin, GPIO_PIN_SET);
-  HAL_Delay(100); //a short delay is important to let the SD card settle
+  HAL_GPIO_WritePin(SD2_CS_GPIO_Port, SD2_CS_Pin, GPIO_PIN_SET);
+  SD_InitStart(0, NULL); //the cards settle and initialize while the loop runs, no need to wait here
+  SD_InitStart(1, NULL); //second socket on SPI2, an empty socket just ends up NOINIT
 
 //  File_op();
   /* USER CODE END 2 */
@@ -129,8 +133,19 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
+	  SD_InitPoll(1);
+	  if (SD_InitPoll(0) == SD_INIT_BUSY)
+		  continue; //other subsystems can be serviced here until the card is up
+
 	  sd_benchmark();
-	  HAL_Delay(2000);
+
+	  /* Let the card erase the clusters freed by the benchmark in the pause */
+	  uint32_t pause = HAL_GetTick();
+	  DWORD budget = 2000;
+	  disk_ioctl(0, CTRL_IDLE, &budget);
+	  pause = HAL_GetTick() - pause;
+	  if (pause < 2000)
+		  HAL_Delay(2000 - pause);
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
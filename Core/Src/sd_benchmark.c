@@ -15,6 +15,9 @@
 
 #include "sd_benchmark.h"
 #include "fatfs.h"
+#include "sd_spi.h"
+#include "sd_stripe.h"
+#include "sd_block.h"
 #include <stdio.h>
 #include <string.h>
 #include "main.h"
@@ -28,6 +31,45 @@
 #define TEST_SIZE 512000 // 500KB Test File
 
 static uint8_t buffer[32768] __attribute__((aligned(4)));
+
+/* Directory sizes for the open latency test */
+static const uint32_t open_test_dirs[] = { 100, 500, 2000 };
+#define OPEN_TEST_COUNT 100 // Number of f_open calls timed per directory
+
+/* Record-sized write/read tests (one f_write/f_read per record, with and without
+ * f_setwbuf/f_setrbuf) */
+#define RECORD_SIZE 128
+#define FILE_BUF_SIZE 8192 // Write-behind/read-ahead buffer, a multiple of the cluster size is best
+static uint8_t file_buf[FILE_BUF_SIZE] __attribute__((aligned(4)));
+
+/* Chunked read test behind a file header (file offset not sector aligned) */
+#define HEADER_SIZE 37
+#define CHUNK_SIZE 4096
+
+/* CSV logging test (f_printf per line, f_sync every LOG_SYNC_LINES lines) */
+#define LOG_LINES 10000
+#define LOG_SYNC_LINES 100
+
+/* Preallocation test (f_lseek past the end of a new file, then f_close) */
+#define PREALLOC_SIZE (64UL * 1024 * 1024)
+
+/* Directory tree test (f_mkdir of a month of per-day directories) */
+#define MKDIR_COUNT 31
+
+/* Line length limit for the f_gets text read test */
+#define LINE_SIZE 128
+
+/* Streaming test (f_forward into a memory-to-memory DMA transfer, DMA2 only) */
+#define STREAM_DMA DMA2_Stream1
+
+/* Entries per f_readdirs call for the directory listing test */
+#define LIST_BATCH 16
+static FFDIRENT list_buf[LIST_BATCH];
+
+/* Raw sector test on drive 0, card 0 alone or both cards striped (SD_USE_STRIPE).
+ * The range is read and written back unchanged, so the volume stays intact. */
+#define RAW_TEST_SIZE (1024UL * 1024)
+#define RAW_TEST_SECTOR 65536 // 32 MB into the drive, clear of the FAT
 /***************************************************************
  * 🚫 DO NOT MODIFY BELOW THIS LINE
  * Auto-generated/system-managed code. Changes may be lost.
@@ -75,6 +117,359 @@ uint32_t sd_benchmark_write(const char *filename, uint32_t size_bytes) {
 	return elapsed;
 }
 
+uint32_t sd_benchmark_records(const char *filename, uint32_t size_bytes, int use_wbuf) {
+	FIL file;
+	UINT written;
+
+	memset(buffer, 0x55, RECORD_SIZE);
+
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (use_wbuf) {
+		res = f_setwbuf(&file, file_buf, sizeof(file_buf));
+		if (res != FR_OK) {
+			printf("f_setwbuf failed: %d\r\n", res);
+		}
+	}
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes;
+
+	while (remaining > 0) {
+		UINT to_write = (remaining > RECORD_SIZE) ? RECORD_SIZE : remaining;
+		res = f_write(&file, buffer, to_write, &written);
+		if (res != FR_OK || written != to_write) {
+			printf("f_write error\r\n");
+			break;
+		}
+		remaining -= written;
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+/* Record log with f_sync every LOG_SYNC_LINES records. With prealloc != 0 the file
+ * is allocated contiguous by f_expand first (not timed) and the writes do not touch
+ * the FAT. */
+uint32_t sd_benchmark_log(const char *filename, uint32_t size_bytes, int prealloc) {
+	FIL file;
+	UINT written;
+
+	memset(buffer, 0x55, RECORD_SIZE);
+
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (prealloc) {
+		res = f_expand(&file, size_bytes, 1);
+		if (res != FR_OK) {
+			printf("f_expand failed: %d\r\n", res);
+		}
+	}
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes;
+	uint32_t n_records = 0;
+
+	while (remaining > 0) {
+		UINT to_write = (remaining > RECORD_SIZE) ? RECORD_SIZE : remaining;
+		res = f_write(&file, buffer, to_write, &written);
+		if (res != FR_OK || written != to_write) {
+			printf("f_write error\r\n");
+			break;
+		}
+		if (++n_records % LOG_SYNC_LINES == 0) {
+			f_sync(&file);
+		}
+		remaining -= written;
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+uint32_t sd_benchmark_prealloc(const char *filename, uint32_t size_bytes) {
+	FIL file;
+
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+
+	uint32_t start = HAL_GetTick();
+	res = f_lseek(&file, size_bytes);
+	if (res != FR_OK || f_tell(&file) != size_bytes) {
+		printf("f_lseek error\r\n");
+	}
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+
+	f_unlink(filename);
+	return elapsed;
+}
+
+uint32_t sd_benchmark_read_records(const char *filename, uint32_t size_bytes, int use_rbuf) {
+	FIL file;
+	UINT read;
+
+	FRESULT res = f_open(&file, filename, FA_READ);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (use_rbuf) {
+		res = f_setrbuf(&file, file_buf, sizeof(file_buf));
+		if (res != FR_OK) {
+			printf("f_setrbuf failed: %d\r\n", res);
+		}
+	}
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes;
+
+	while (remaining > 0) {
+		UINT to_read = (remaining > RECORD_SIZE) ? RECORD_SIZE : remaining;
+		res = f_read(&file, buffer, to_read, &read);
+		if (res != FR_OK || read != to_read) {
+			printf("f_read error\r\n");
+			break;
+		}
+		remaining -= read;
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+uint32_t sd_benchmark_read_header(const char *filename, uint32_t size_bytes, int use_rbuf) {
+	FIL file;
+	UINT read;
+
+	FRESULT res = f_open(&file, filename, FA_READ);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (use_rbuf) {
+		f_setrbuf(&file, file_buf, sizeof(file_buf));
+	}
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes - HEADER_SIZE;
+
+	res = f_read(&file, buffer, HEADER_SIZE, &read); // Skip the header
+	while (res == FR_OK && remaining > 0) {
+		UINT to_read = (remaining > CHUNK_SIZE) ? CHUNK_SIZE : remaining;
+		res = f_read(&file, buffer, to_read, &read);
+		if (res != FR_OK || read != to_read) {
+			printf("f_read error\r\n");
+			break;
+		}
+		remaining -= read;
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+uint32_t sd_benchmark_printf(const char *filename, uint32_t n_lines, int use_wbuf) {
+	FIL file;
+
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (use_wbuf) {
+		res = f_setwbuf(&file, file_buf, sizeof(file_buf));
+		if (res != FR_OK) {
+			printf("f_setwbuf failed: %d\r\n", res);
+		}
+	}
+
+	uint32_t start = HAL_GetTick();
+
+	for (uint32_t i = 0; i < n_lines; i++) {
+		if (f_printf(&file, "%06lu,sensor%02lu,%lu.%02lu\n", i, i % 32, i % 100, i % 97) < 0) {
+			printf("f_printf error\r\n");
+			break;
+		}
+		if ((i + 1) % LOG_SYNC_LINES == 0) {
+			f_sync(&file);
+		}
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+uint32_t sd_benchmark_gets(const char *filename, uint32_t size_bytes, uint32_t *n_lines) {
+	FIL file;
+	UINT written;
+	char line[LINE_SIZE];
+	uint32_t len = 0;
+
+	*n_lines = 0;
+	while (len < sizeof(buffer) - LINE_SIZE) { // CSV-like text, ~30 bytes per line
+		len += snprintf((char*) buffer + len, LINE_SIZE, "%06lu,sensor%02lu,%lu.%02lu\n",
+				len, len % 32, len % 100, len % 97);
+	}
+
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	for (uint32_t done = 0; done < size_bytes; done += written) {
+		res = f_write(&file, buffer, (size_bytes - done > len) ? len : size_bytes - done, &written);
+		if (res != FR_OK || written == 0) {
+			printf("f_write error\r\n");
+			break;
+		}
+	}
+	f_close(&file);
+
+	res = f_open(&file, filename, FA_READ);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+
+	uint32_t start = HAL_GetTick();
+
+	while (f_gets(line, sizeof(line), &file)) {
+		(*n_lines)++;
+	}
+
+	uint32_t elapsed = HAL_GetTick() - start;
+	f_close(&file);
+	return elapsed;
+}
+
+uint32_t sd_benchmark_checksum(const char *filename, uint32_t size_bytes, int use_view, uint32_t *sum) {
+	FIL file;
+	UINT n;
+
+	*sum = 0;
+	FRESULT res = f_open(&file, filename, FA_READ);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	f_setrbuf(&file, file_buf, sizeof(file_buf));
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes;
+
+	while (remaining > 0) {
+		const uint8_t *data = buffer;
+		if (use_view) {
+			res = f_getview(&file, (const void**) &data, remaining, &n); // Data stays in the read-ahead buffer
+		} else {
+			res = f_read(&file, buffer, (remaining > sizeof(file_buf)) ? sizeof(file_buf) : remaining, &n);
+		}
+		if (res != FR_OK || n == 0) {
+			printf("read error\r\n");
+			break;
+		}
+		for (UINT i = 0; i < n; i++) {
+			*sum += data[i];
+		}
+		remaining -= n;
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
+static DMA_HandleTypeDef hdma_stream;
+
+/* f_forward streaming function. The data is copied into buffer[] by the DMA and the
+ * function returns without waiting, the sense call reports busy until it is done. */
+static UINT stream_out(const BYTE *data, UINT btf) {
+	if (btf == 0) { // Sense call
+		if (hdma_stream.State != HAL_DMA_STATE_BUSY) {
+			return 1;
+		}
+		if (!__HAL_DMA_GET_FLAG(&hdma_stream, __HAL_DMA_GET_TC_FLAG_INDEX(&hdma_stream))) {
+			return 0;
+		}
+		HAL_DMA_PollForTransfer(&hdma_stream, HAL_DMA_FULL_TRANSFER, 0); // Clears the flags
+		return 1;
+	}
+	if (btf > sizeof(buffer)) {
+		btf = sizeof(buffer);
+	}
+	if (HAL_DMA_Start(&hdma_stream, (uint32_t) data, (uint32_t) buffer, btf) != HAL_OK) {
+		return 0;
+	}
+	return btf;
+}
+
+uint32_t sd_benchmark_stream(const char *filename, uint32_t size_bytes, int use_rbuf) {
+	FIL file;
+	UINT n;
+
+	hdma_stream.Instance = STREAM_DMA;
+	hdma_stream.Init.Channel = DMA_CHANNEL_0;
+	hdma_stream.Init.Direction = DMA_MEMORY_TO_MEMORY;
+	hdma_stream.Init.PeriphInc = DMA_PINC_ENABLE;
+	hdma_stream.Init.MemInc = DMA_MINC_ENABLE;
+	hdma_stream.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	hdma_stream.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	hdma_stream.Init.Mode = DMA_NORMAL;
+	hdma_stream.Init.Priority = DMA_PRIORITY_LOW;
+	hdma_stream.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+	hdma_stream.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+	hdma_stream.Init.MemBurst = DMA_MBURST_SINGLE;
+	hdma_stream.Init.PeriphBurst = DMA_PBURST_SINGLE;
+	if (HAL_DMA_Init(&hdma_stream) != HAL_OK) {
+		printf("DMA init failed\r\n");
+		return 0;
+	}
+
+	FRESULT res = f_open(&file, filename, FA_READ);
+	if (res != FR_OK) {
+		printf("f_open failed: %d\r\n", res);
+		return 0;
+	}
+	if (use_rbuf) {
+		f_setrbuf(&file, file_buf, sizeof(file_buf)); // Streaming mode, two banks of FILE_BUF_SIZE / 2
+	}
+
+	uint32_t start = HAL_GetTick();
+	uint32_t remaining = size_bytes;
+
+	while (remaining > 0) {
+		res = f_forward(&file, stream_out, remaining, &n); // Returns early while the DMA is busy
+		if (res != FR_OK || (n == 0 && f_eof(&file))) {
+			printf("f_forward error\r\n");
+			break;
+		}
+		remaining -= n;
+	}
+	while (!stream_out(0, 0)) {
+		// Wait for the last transfer
+	}
+
+	f_close(&file);
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed;
+}
+
 uint32_t sd_benchmark_read(const char *filename, uint32_t size_bytes) {
 	FIL file;
 	UINT read;
@@ -103,10 +498,152 @@ uint32_t sd_benchmark_read(const char *filename, uint32_t size_bytes) {
 	return elapsed;
 }
 
+/* Read the sectors in buffer-sized requests and write each request back,
+ * timing the reads and the writes (until programmed) separately */
+uint32_t sd_benchmark_raw(BYTE pdrv, LBA_t sector, uint32_t size_bytes, uint32_t *wr_ms) {
+	UINT n = sizeof(buffer) / 512;
+	uint32_t rd = 0, t;
+
+	*wr_ms = 0;
+	for (uint32_t done = 0; done < size_bytes; done += n * 512, sector += n) {
+		t = HAL_GetTick();
+		if (disk_read(pdrv, buffer, sector, n) != RES_OK) {
+			printf("disk_read error\r\n");
+			return 0;
+		}
+		rd += HAL_GetTick() - t;
+
+		t = HAL_GetTick();
+		if (disk_write(pdrv, buffer, sector, n) != RES_OK
+				|| disk_ioctl(pdrv, CTRL_SYNC, NULL) != RES_OK) {
+			printf("disk_write error\r\n");
+			*wr_ms = 0;
+			return 0;
+		}
+		*wr_ms += HAL_GetTick() - t;
+	}
+
+	return rd;
+}
+
+/* Create a month of per-day directories under dirname and return the time
+ * taken, then remove them again. Each f_mkdir clears a whole cluster. */
+uint32_t sd_benchmark_mkdir(const char *dirname, uint32_t n_dirs) {
+	char path[32];
+	uint32_t i;
+
+	FRESULT res = f_mkdir(dirname);
+	if (res != FR_OK && res != FR_EXIST) {
+		printf("f_mkdir failed: %d\r\n", res);
+		return 0;
+	}
+
+	uint32_t start = HAL_GetTick();
+
+	for (i = 0; i < n_dirs; i++) {
+		snprintf(path, sizeof(path), "%s/d%02lu", dirname, i + 1);
+		res = f_mkdir(path);
+		if (res != FR_OK) {
+			printf("f_mkdir error\r\n");
+			break;
+		}
+	}
+
+	uint32_t elapsed = HAL_GetTick() - start;
+
+	while (i--) {
+		snprintf(path, sizeof(path), "%s/d%02lu", dirname, i + 1);
+		f_unlink(path);
+	}
+	f_unlink(dirname);
+	return elapsed;
+}
+
+/* Fill the directory with n_files empty files (once) and return the average
+ * f_open/f_close time in microseconds. Files are opened spread over the whole
+ * directory when spread != 0, otherwise the newest file is reopened. */
+uint32_t sd_benchmark_open(const char *dirname, uint32_t n_files, int spread) {
+	FIL file;
+	char path[32];
+	uint32_t i;
+
+	FRESULT res = f_mkdir(dirname);
+	if (res == FR_OK) {
+		for (i = 0; i < n_files; i++) {
+			snprintf(path, sizeof(path), "%s/rec_%05lu.csv", dirname, i);
+			res = f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE);
+			if (res != FR_OK) {
+				printf("f_open failed: %d\r\n", res);
+				return 0;
+			}
+			f_close(&file);
+		}
+	} else if (res != FR_EXIST) {
+		printf("f_mkdir failed: %d\r\n", res);
+		return 0;
+	}
+
+	uint32_t start = HAL_GetTick();
+
+	for (i = 0; i < OPEN_TEST_COUNT; i++) {
+		uint32_t idx = spread ? (i * n_files) / OPEN_TEST_COUNT : n_files - 1;
+		snprintf(path, sizeof(path), "%s/rec_%05lu.csv", dirname, idx);
+		res = f_open(&file, path, FA_READ);
+		if (res != FR_OK) {
+			printf("f_open error\r\n");
+			break;
+		}
+		f_close(&file);
+	}
+
+	uint32_t elapsed = HAL_GetTick() - start;
+	return elapsed * 1000 / OPEN_TEST_COUNT;
+}
+
+uint32_t sd_benchmark_list(const char *dirname, int batched, uint32_t *n_items) {
+	DIR dir;
+	FILINFO fno;
+	UINT nr;
+	FRESULT res;
+
+	*n_items = 0;
+	uint32_t start = HAL_GetTick();
+
+	res = f_opendir(&dir, dirname);
+	if (res != FR_OK) {
+		printf("f_opendir failed: %d\r\n", res);
+		return 0;
+	}
+	for (;;) {
+		if (batched) {
+			res = f_readdirs(&dir, list_buf, LIST_BATCH, &nr);
+			if (res != FR_OK || nr == 0) break;
+			*n_items += nr;
+		} else {
+			res = f_readdir(&dir, &fno);
+			if (res != FR_OK || fno.fname[0] == 0) break;
+			(*n_items)++;
+		}
+	}
+	f_closedir(&dir);
+	if (res != FR_OK) {
+		printf("list error: %d\r\n", res);
+	}
+
+	return HAL_GetTick() - start;
+}
+
 void sd_benchmark(void) {
 	uint32_t start = HAL_GetTick();
 	if (f_mount(&USERFatFS, "", 1) == FR_OK) {
 		printf("\r\nStarting Benchmark Test\r\n");
+
+		SD_Status card;
+		if (disk_ioctl(0, SD_GET_STATUS, &card) == RES_OK) {
+			printf("Card: class %u, U%u, V%u, AU %lu KB\r\n", card.speed_class, card.uhs_grade,
+					card.video_class, card.au_sectors / 2);
+		}
+
 		uint32_t w = sd_benchmark_write("bench.bin", TEST_SIZE);
 		uint32_t r = sd_benchmark_read("bench.bin", TEST_SIZE);
 
@@ -116,11 +653,113 @@ void sd_benchmark(void) {
 		printf("Write speed: %lu KB/s\r\n", write_time);
 		printf("Read  speed: %lu KB/s\r\n", read_time);
 
+		uint32_t rec = sd_benchmark_records("records.csv", TEST_SIZE, 0);
+		uint32_t rec_wb = sd_benchmark_records("records.csv", TEST_SIZE, 1);
+		printf("Record write (%d B): %lu KB/s, %lu KB/s (write-behind)\r\n", RECORD_SIZE,
+				rec != 0 ? (TEST_SIZE / 1024 * 1000) / rec : 0,
+				rec_wb != 0 ? (TEST_SIZE / 1024 * 1000) / rec_wb : 0);
+
+		uint32_t lg = sd_benchmark_log("daily.log", TEST_SIZE, 0);
+		uint32_t lg_pre = sd_benchmark_log("daily.log", TEST_SIZE, 1);
+		printf("Record log (f_sync every %d): %lu KB/s, %lu KB/s (preallocated)\r\n", LOG_SYNC_LINES,
+				lg != 0 ? (TEST_SIZE / 1024 * 1000) / lg : 0,
+				lg_pre != 0 ? (TEST_SIZE / 1024 * 1000) / lg_pre : 0);
+
+		uint32_t pa = sd_benchmark_prealloc("prealloc.bin", PREALLOC_SIZE);
+		printf("Preallocate %lu MB (f_lseek): %lu ms\r\n", PREALLOC_SIZE / (1024 * 1024), pa);
+
+		uint32_t md = sd_benchmark_mkdir("month", MKDIR_COUNT);
+		printf("Create %d directories (f_mkdir): %lu ms\r\n", MKDIR_COUNT, md);
+
+		rec = sd_benchmark_read_records("records.csv", TEST_SIZE, 0);
+		uint32_t rec_ra = sd_benchmark_read_records("records.csv", TEST_SIZE, 1);
+		printf("Record read  (%d B): %lu KB/s, %lu KB/s (read-ahead)\r\n", RECORD_SIZE,
+				rec != 0 ? (TEST_SIZE / 1024 * 1000) / rec : 0,
+				rec_ra != 0 ? (TEST_SIZE / 1024 * 1000) / rec_ra : 0);
+
+		uint32_t h = sd_benchmark_read_header("bench.bin", TEST_SIZE, 0);
+		uint32_t h_ra = sd_benchmark_read_header("bench.bin", TEST_SIZE, 1);
+		printf("Read after %d B header (%d B): %lu KB/s, %lu KB/s (read-ahead)\r\n", HEADER_SIZE, CHUNK_SIZE,
+				h != 0 ? (TEST_SIZE / 1024 * 1000) / h : 0,
+				h_ra != 0 ? (TEST_SIZE / 1024 * 1000) / h_ra : 0);
+
+		uint32_t p = sd_benchmark_printf("log.csv", LOG_LINES, 0);
+		uint32_t p_wb = sd_benchmark_printf("log.csv", LOG_LINES, 1);
+		printf("CSV log (f_printf): %lu lines/s, %lu lines/s (write-behind)\r\n",
+				p != 0 ? LOG_LINES * 1000 / p : 0,
+				p_wb != 0 ? LOG_LINES * 1000 / p_wb : 0);
+
+		uint32_t sum, sum_view;
+		uint32_t c = sd_benchmark_checksum("bench.bin", TEST_SIZE, 0, &sum);
+		uint32_t c_view = sd_benchmark_checksum("bench.bin", TEST_SIZE, 1, &sum_view);
+		printf("Checksum: %lu KB/s (f_read), %lu KB/s (f_getview)%s\r\n",
+				c != 0 ? (TEST_SIZE / 1024 * 1000) / c : 0,
+				c_view != 0 ? (TEST_SIZE / 1024 * 1000) / c_view : 0,
+				sum == sum_view ? "" : " MISMATCH");
+
+		uint32_t st = sd_benchmark_stream("bench.bin", TEST_SIZE, 0);
+		uint32_t st_db = sd_benchmark_stream("bench.bin", TEST_SIZE, 1);
+		printf("Stream (f_forward to DMA): %lu KB/s, %lu KB/s (double-buffered)\r\n",
+				st != 0 ? (TEST_SIZE / 1024 * 1000) / st : 0,
+				st_db != 0 ? (TEST_SIZE / 1024 * 1000) / st_db : 0);
+
+		uint32_t n_lines;
+		uint32_t g = sd_benchmark_gets("text.csv", TEST_SIZE, &n_lines);
+		printf("Text read (f_gets): %lu KB/s, %lu lines\r\n",
+				g != 0 ? (TEST_SIZE / 1024 * 1000) / g : 0, n_lines);
+
+		for (uint32_t i = 0; i < sizeof(open_test_dirs) / sizeof(open_test_dirs[0]); i++) {
+			char dirname[16];
+			snprintf(dirname, sizeof(dirname), "open%lu", open_test_dirs[i]);
+			uint32_t t_spread = sd_benchmark_open(dirname, open_test_dirs[i], 1);
+			uint32_t t_newest = sd_benchmark_open(dirname, open_test_dirs[i], 0);
+			printf("Open  %5lu files: %lu us (spread), %lu us (newest)\r\n",
+					open_test_dirs[i], t_spread, t_newest);
+
+			uint32_t n_single, n_batch;
+			uint32_t t_single = sd_benchmark_list(dirname, 0, &n_single);
+			uint32_t t_batch = sd_benchmark_list(dirname, 1, &n_batch);
+			printf("List  %5lu items: %lu ms (f_readdir), %lu ms (f_readdirs)\r\n",
+					n_batch, t_single, t_batch);
+		}
+
 		f_mount(NULL, "", 0);
 
+		uint32_t raw_wr;
+		uint32_t raw_rd = sd_benchmark_raw(0, RAW_TEST_SECTOR, RAW_TEST_SIZE, &raw_wr);
+		printf("Raw read:  %lu KB/s, write: %lu KB/s (%s)\r\n",
+				raw_rd != 0 ? (RAW_TEST_SIZE / 1024 * 1000) / raw_rd : 0,
+				raw_wr != 0 ? (RAW_TEST_SIZE / 1024 * 1000) / raw_wr : 0,
+				SD_USE_STRIPE ? "2 cards striped" : "1 card");
+
+		SD_Stats err;
+		if (disk_ioctl(0, SD_GET_STATS, &err) == RES_OK && err.errors) {
+			printf("Link errors: %lu (resync %lu, restart %lu, reinit %lu, failed %lu)\r\n",
+					err.errors, err.resync, err.restart, err.reinit, err.failed);
+		}
+
+		static BlockStats req;
+		if (disk_ioctl(0, BLOCK_GET_STATS, &req) == RES_OK) {
+			printf("Requests: %lu reads (%lu sectors, %lu ms), %lu writes (%lu sectors, %lu ms), %lu syncs (%lu ms)\r\n",
+					req.reads, req.read_sectors, req.read_ms, req.writes, req.write_sectors, req.write_ms,
+					req.flushes, req.flush_ms);
+		}
+
+		BlockCacheStats cache;
+		if (disk_ioctl(0, BLOCK_GET_CACHE, &cache) == RES_OK) {
+			printf("Cache: %lu hits, %lu misses, %lu evictions, %lu writes absorbed, %lu sectors in %lu write-backs\r\n",
+					cache.hits, cache.misses, cache.evictions, cache.absorbed, cache.written, cache.writebacks);
+		}
+
 		uint32_t elapsed = HAL_GetTick() - start;
 		printf("Overal Time: %lums\r\n", elapsed);
 	} else {
-		printf("Cart Error...\r\n");
+		BlockCacheStats cache;
+		if (disk_ioctl(0, BLOCK_GET_CACHE, &cache) == RES_OK && cache.lost) {
+			printf("Cache: %lu dirty sectors lost with the card, check the volume\r\n", cache.lost);
+			disk_ioctl(0, BLOCK_CLEAR_LOST, NULL); // The next run mounts it again
+		} else {
+			printf("Cart Error...\r\n");
+		}
 	}
 }